@@ -28,11 +28,67 @@
  * they are the same entity from the POV of the kernel locking
  * code.
  *
+ * To get real conflicts and waiter queues, use -m to select one of
+ *   threads	POSIX locks from threads sharing one file (the default)
+ *   ofd	OFD locks from threads that each have a file of their own.
+ *		The close threads tear them down in turn.
+ *   procs	POSIX locks from separate processes, each with its own
+ *		close thread racing against its own locker.
+ *
  * This is a regression test for some old and really annoying kernel
  * bug - the nfs file locking code was racing with file close, producing
  * bad errors and oopses.
+ *
+ * With -w, locks are requested with F_SETLKW, and every locker gives
+ * up after 2 seconds, or the number of msec given with -W. Each thread
+ * has a timer of its own, which signals only that thread, so that one
+ * thread's timeout does not interrupt another thread's wait.
+ *
+ * The lockers go round-robin over all files given with -f, and -c sets
+ * the number of close threads that tear down the file descriptors
+ * underneath them. The ways to tear them down are selected with -r:
+ *   close		close the file and open it again (the default)
+ *   dup2		dup2() a new open file over the locked descriptor
+ *   dup-close		close a dup of the locked descriptor
+ *   close_range	close_range() the descriptor and open it again
+ *   exec		mark the descriptor close-on-exec and fork+exec
+ * For each race type, the test reports how often it ran, and how often
+ * a locker was inside a lock call or holding the lock at the time.
+ *
+ * Fixed hold and open times (-H, -O) make the threads fall into a steady
+ * rhythm that keeps producing the same interleavings. With -j seed, every
+ * delay is drawn at random instead: no delay at all, a short busy loop
+ * well below a microsecond, a sched_yield(), or a sleep of up to twice
+ * the configured time. Lockers also pause randomly between operations.
+ * Each thread has its own generator, derived from the seed.
+ *
+ * To see how much of the state space was covered, each locker keeps the
+ * outcomes (success, nolock, EBADF, other error) of its last SEQ_LEN
+ * lock calls, and every distinct sequence is recorded. The test reports
+ * how many of the possible sequences were seen. With -s secs, it stops
+ * early once no new sequence has shown up for that long.
+ *
+ * Closing a file has to release every POSIX lock the process holds on
+ * it, and flush its dirty data; on NFS, each of those is an RPC. With
+ * -l locks, lockers take up to that many single-byte locks instead of
+ * one whole-file lock, and with -D kbytes, they write up to that much
+ * data while holding them. Both go up in powers of two, lock count
+ * first, so that all combinations get their turn. The close threads
+ * time every close(), dup2() and close_range(), and report latency
+ * by the number of locks held and the amount of dirty data at the time.
+ * Lockers publish every lock and every 64K of data as they go. This
+ * needs one lock owner per file descriptor, so it only works with the
+ * ofd and procs modes.
+ *
+ * The test runs for 5 seconds, or as long as given with -d. At the end,
+ * it reports the rate of successful locks, of EBADF errors and of
+ * close/open cycles, per thread and in total. This shows how hard the
+ * race was actually exercised. The counters of every thread live in a
+ * cache line of their own, so the threads do not slow each other down
+ * just by counting.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -42,11 +98,28 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
 
-#define MAX_THREADS	64
+#define CACHELINE	64
+#define SEQ_LEN		4
+#define NUM_SEQS	(1 << (2 * SEQ_LEN))	/* 4 outcomes each */
+#define MAX_LOCKS	(1 << 20)
+#define MAX_DIRTY	(1 << 20)		/* KiB */
+#define LOCK_BUCKETS	22			/* 0, 1, 2-3, 4-7, ... */
+#define DIRTY_BUCKETS	22			/* 0, 1K, 2-3K, 4-7K, ... */
+#define LAT_BUCKETS	32			/* log2 of usec */
+#define DIRTY_CHUNK	(64 * 1024)
+
+/* Older glibc versions do not define this */
+#ifndef sigev_notify_thread_id
+# define sigev_notify_thread_id	_sigev_un._tid
+#endif
 
 enum {
 	STAT_SUCCESS = 0,
@@ -57,44 +130,253 @@ enum {
 	__STAT_MAX
 };
 
+enum {
+	MODE_THREADS,
+	MODE_OFD,
+	MODE_PROCS,
+};
+
+enum {
+	RACE_CLOSE,
+	RACE_DUP2,
+	RACE_DUP_CLOSE,
+	RACE_CLOSE_RANGE,
+	RACE_EXEC,
+
+	__RACE_MAX
+};
+
+static const char *	race_name[__RACE_MAX] = {
+	[RACE_CLOSE]		= "close",
+	[RACE_DUP2]		= "dup2",
+	[RACE_DUP_CLOSE]	= "dup-close",
+	[RACE_CLOSE_RANGE]	= "close_range",
+	[RACE_EXEC]		= "exec",
+};
+
 static char *		opt_filename = NULL;
 static unsigned int	opt_threads = 1;
 static unsigned int	opt_holdtime = 0;
 static unsigned int	opt_opentime = 0;
 static int		opt_lockwait = 0;
 static int		opt_noprogress = 0;
+static unsigned int	opt_duration = 5;
+static int		opt_mode = MODE_THREADS;
+static unsigned int	opt_waittime = 2000;
+static unsigned int	opt_files = 1;
+static unsigned int	opt_closers = 1;
+static unsigned int	opt_races = 1 << RACE_CLOSE;
+static int		opt_jitter = 0;
+static unsigned long	opt_seed;
+static unsigned int	opt_stall = 0;
+static unsigned int	opt_locks = 0;
+static unsigned int	opt_dirty = 0;		/* KiB */
 
-static int		running = 1;
-static volatile int	the_file = -1;
+static volatile int	running = 1;
 struct stats {
-	unsigned int	success, nolock, badfile, other;
+	unsigned long	success, nolock, badfile, other;
+	unsigned long	race[__RACE_MAX];
+	unsigned long	overlap[__RACE_MAX];
+} __attribute__((aligned(CACHELINE)));
+
+/*
+ * A file descriptor the lockers lock through, and the closers tear
+ * down. Normally, there is one per file. With OFD locks, every locker
+ * has its own set. busy counts the lockers inside a lock call or
+ * holding the lock.
+ */
+struct slot {
+	volatile int	fd;
+	volatile int	busy;
+	unsigned int	file;
+	volatile unsigned long locks;
+	volatile unsigned long dirty;
+} __attribute__((aligned(CACHELINE)));
+
+static char **		files;
+static struct slot *	slots;
+static unsigned int	nslots;
+
+/*
+ * Outcome sequences seen so far, shared by all lockers
+ */
+struct coverage {
+	volatile unsigned char	seen[NUM_SEQS];
+	volatile unsigned int	count;
+	volatile double		last_new;
 };
 
+/*
+ * close() latency of one close thread, by number of locks held
+ * and bytes of dirty data
+ */
+struct close_cell {
+	unsigned long	count;
+	double		sum, max;
+	unsigned long	hist[LAT_BUCKETS];
+};
+
+struct close_cost {
+	struct close_cell cell[LOCK_BUCKETS][DIRTY_BUCKETS];
+} __attribute__((aligned(CACHELINE)));
+
+static struct stats *	stats;
+static struct stats *	closers;
+static struct coverage *coverage;
+static struct close_cost *close_cost;
+static char *		dirty_buf;
+static __thread unsigned long jitter_state;
+static __thread timer_t	lock_timer;
+
 static void
 timeout(int sig)
 {
 	/* nothing */
 }
 
+static void
+stop(int sig)
+{
+	running = 0;
+}
+
+static double		now(void);
+
+static unsigned int
+log2_bucket(unsigned long val, unsigned int max)
+{
+	unsigned int b = 0;
+
+	while (val && b < max - 1) {
+		val >>= 1;
+		b++;
+	}
+	return b;
+}
+
+/*
+ * Random delays (xorshift64)
+ */
+static void
+jitter_init(unsigned long id)
+{
+	jitter_state = (opt_seed + 1) * 0x9e3779b97f4a7c15UL + id * 0xbf58476d1ce4e5b9UL;
+	if (jitter_state == 0)
+		jitter_state = 1;
+}
+
+static unsigned long
+jitter_next(void)
+{
+	jitter_state ^= jitter_state << 13;
+	jitter_state ^= jitter_state >> 7;
+	jitter_state ^= jitter_state << 17;
+	return jitter_state;
+}
+
+static void
+jitter(unsigned int usec)
+{
+	unsigned long r = jitter_next();
+	unsigned long i, n;
+
+	switch (r & 3) {
+	case 0:
+		break;
+
+	case 1:
+		n = (r >> 2) % 512;
+		for (i = 0; i < n; i++)
+			__asm__ __volatile__("" ::: "memory");
+		break;
+
+	case 2:
+		sched_yield();
+		break;
+
+	case 3:
+		usleep((r >> 2) % (2 * usec + 1));
+		break;
+	}
+}
+
+static void
+delay(unsigned int usec)
+{
+	if (opt_jitter)
+		jitter(usec);
+	else if (usec)
+		usleep(usec);
+}
+
+/*
+ * Record the sequence of the last SEQ_LEN outcomes. The local
+ * bitmap keeps us from hammering the shared one.
+ */
+static void
+record_outcome(unsigned int *seq, unsigned long n, unsigned char *seen, int res)
+{
+	*seq = ((*seq << 2) | res) & (NUM_SEQS - 1);
+	if (n + 1 < SEQ_LEN || seen[*seq])
+		return;
+
+	seen[*seq] = 1;
+	if (__sync_lock_test_and_set(&coverage->seen[*seq], 1) == 0) {
+		__sync_fetch_and_add(&coverage->count, 1);
+		coverage->last_new = now();
+	}
+}
+
+/*
+ * Create a timer that delivers SIGALRM to the calling thread only
+ */
+static void
+timer_init(void)
+{
+	struct sigevent sev;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_MONOTONIC, &sev, &lock_timer) < 0) {
+		perror("timer_create");
+		exit(1);
+	}
+}
+
+static void
+timer_arm(unsigned int msec)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+	timer_settime(lock_timer, 0, &its, NULL);
+}
+
 /*
  * Make the flock request
  */
 static int
-make_lock(int fd, int type, int wait)
+make_lock(int fd, int type, int wait, off_t start, off_t len)
 {
 	struct flock    fl;
 	int		cmd, res;
 
 	fl.l_type = type;
 	fl.l_whence = SEEK_SET;
-	fl.l_start = 0;
-	fl.l_len = 0;
+	fl.l_start = start;
+	fl.l_len = len;
+	fl.l_pid = 0;
 
 	if (wait) {
-		cmd = F_SETLKW;
-		alarm(2);
+		cmd = (opt_mode == MODE_OFD)? F_OFD_SETLKW : F_SETLKW;
+		if (opt_waittime)
+			timer_arm(opt_waittime);
 	} else {
-		cmd = F_SETLK;
+		cmd = (opt_mode == MODE_OFD)? F_OFD_SETLK : F_SETLK;
 	}
 
 	res = fcntl(fd, cmd, &fl);
@@ -120,89 +402,516 @@ make_lock(int fd, int type, int wait)
 		}
 	}
 
-	if (wait)
-		alarm(0);
+	if (wait && opt_waittime)
+		timer_arm(0);
 	return res;
 }
 
+/*
+ * Take more single-byte locks on top of the first one, with a gap
+ * in between so they do not get merged. Every lock is published
+ * as soon as we have it, so the close threads see what we hold.
+ */
+static void
+lock_more(struct slot *sl, unsigned long count)
+{
+	unsigned long i;
+
+	sl->locks = 1;
+	for (i = 1; i < count && running; i++) {
+		if (make_lock(sl->fd, F_WRLCK, 0, 2 * i, 1) != STAT_SUCCESS)
+			break;
+		sl->locks = i + 1;
+	}
+}
+
+/*
+ * Dirty the given amount of data, a chunk at a time
+ */
+static void
+dirty_more(struct slot *sl, unsigned long bytes)
+{
+	unsigned long done, chunk;
+
+	for (done = 0; done < bytes && running; done += chunk) {
+		chunk = MIN(bytes - done, DIRTY_CHUNK);
+		if (pwrite(sl->fd, dirty_buf + done, chunk, done) < 0)
+			break;
+		sl->dirty = done + chunk;
+	}
+}
+
 void *
 lock_unlock(void *arg)
 {
 	struct stats *st = (struct stats *) arg;
+	struct slot *base = slots, *sl;
+	unsigned char seen[NUM_SEQS];
+	unsigned int seq = 0;
+	unsigned int lock_steps = 1 + log2_bucket(opt_locks, LOCK_BUCKETS);
+	unsigned int dirty_steps = 1 + log2_bucket(opt_dirty, DIRTY_BUCKETS);
+	unsigned long n, want, dirty;
+	int	res;
 
-	while (running) {
-		switch (make_lock(the_file, F_WRLCK, opt_lockwait)) {
+	memset(seen, 0, sizeof(seen));
+	if (opt_jitter)
+		jitter_init(st - stats);
+
+	/* With OFD locks, every thread has files of its own */
+	if (opt_mode == MODE_OFD)
+		base = &slots[(st - stats) * opt_files];
+
+	if (opt_lockwait && opt_waittime)
+		timer_init();
+
+	for (n = 0; running; n++) {
+		sl = &base[n % opt_files];
+
+		/* 1, 2, 4, ... locks, then the same with more dirty data */
+		want = opt_locks? MIN(1UL << (n % lock_steps), opt_locks) : 0;
+		dirty = (n / lock_steps) % dirty_steps;
+		dirty = dirty? MIN(1UL << (dirty - 1), opt_dirty) * 1024 : 0;
+
+		__sync_fetch_and_add(&sl->busy, 1);
+		if (want)
+			res = make_lock(sl->fd, F_WRLCK, opt_lockwait, 0, 1);
+		else
+			res = make_lock(sl->fd, F_WRLCK, opt_lockwait, 0, 0);
+		switch (res) {
 		case STAT_SUCCESS:	/* success */
 			if (!opt_noprogress && (st->success % 64) == 0)
 				write(1, ".", 1);
 			st->success++;
 			break;
 
-		case STAT_NOLOCK:	/* cannot get lock - should not happen */
+		case STAT_NOLOCK:	/* cannot get lock - conflict, or timed out */
 			st->nolock++;
-			continue;
+			break;
 
 		case STAT_BADFILE:
 			st->badfile++;
-			continue;
+			break;
 
 		default:	/* other error */
 			st->other++;
-			continue;
+			break;
 		}
 
-		/* Hold the lock for a given amount of time. */
-		if (opt_holdtime)
-			usleep(opt_holdtime);
+		record_outcome(&seq, n, seen, res);
+
+		if (res == STAT_SUCCESS) {
+			if (close_cost) {
+				lock_more(sl, want);
+				dirty_more(sl, dirty);
+			}
+
+			/* Hold the lock for a given amount of time. */
+			delay(opt_holdtime);
 
-		/* this may fail if the fd was
-		 * closed in the meantime. */
-		make_lock(the_file, F_UNLCK, 0);
+			sl->locks = 0;
+			sl->dirty = 0;
+
+			/* this may fail if the fd was
+			 * closed in the meantime. */
+			make_lock(sl->fd, F_UNLCK, 0, 0, 0);
+		}
+		__sync_fetch_and_sub(&sl->busy, 1);
+
+		if (opt_jitter)
+			jitter(0);
 	} 
+
+	if (opt_lockwait && opt_waittime)
+		timer_delete(lock_timer);
 	return (NULL);
 }
 
+static int
+open_file(unsigned int file)
+{
+	int	fd;
+
+	if ((fd = open(files[file], O_RDWR|O_CREAT, 0600)) < 0)
+		perror(files[file]);
+	return fd;
+}
+
+/*
+ * Tear down the file descriptor of a slot in one of several ways.
+ * Returns how long the call that closed the file took, in usec,
+ * or -1 if there was none.
+ */
+static double
+race(struct slot *sl, int type)
+{
+	int	fd = sl->fd, nfd;
+	double	t0, lat = -1;
+	pid_t	pid;
+
+	switch (type) {
+	case RACE_CLOSE:
+		if (fd >= 0) {
+			t0 = now();
+			close(fd);
+			lat = (now() - t0) * 1e6;
+		}
+		sl->fd = open_file(sl->file);
+		break;
+
+	case RACE_DUP2:
+		/* The descriptor number stays valid throughout */
+		if ((nfd = open_file(sl->file)) < 0)
+			break;
+		if (fd < 0)
+			sl->fd = nfd;
+		else {
+			t0 = now();
+			dup2(nfd, fd);
+			lat = (now() - t0) * 1e6;
+			close(nfd);
+		}
+		break;
+
+	case RACE_DUP_CLOSE:
+		/* Closing any descriptor drops our POSIX locks */
+		if (fd >= 0 && (nfd = dup(fd)) >= 0) {
+			t0 = now();
+			close(nfd);
+			lat = (now() - t0) * 1e6;
+		}
+		break;
+
+	case RACE_CLOSE_RANGE:
+#ifdef SYS_close_range
+		if (fd >= 0) {
+			t0 = now();
+			syscall(SYS_close_range, fd, fd, 0);
+			lat = (now() - t0) * 1e6;
+		}
+#endif
+		sl->fd = open_file(sl->file);
+		break;
+
+	case RACE_EXEC:
+		if (fd < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+			break;
+		pid = fork();
+		if (pid == 0) {
+			execl("/bin/true", "true", (char *) NULL);
+			_exit(127);
+		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		break;
+	}
+	return lat;
+}
+
+static void
+close_record(struct close_cost *cc, unsigned long locks, unsigned long dirty, double lat)
+{
+	struct close_cell *cell;
+
+	cell = &cc->cell[log2_bucket(locks, LOCK_BUCKETS)][log2_bucket(dirty / 1024, DIRTY_BUCKETS)];
+	cell->count++;
+	cell->sum += lat;
+	if (lat > cell->max)
+		cell->max = lat;
+	cell->hist[log2_bucket((unsigned long) lat, LAT_BUCKETS)]++;
+}
+
 void *
 open_close(void *arg)
 {
+	struct stats *st = (struct stats *) arg;
+	unsigned int i, me = (st - closers) % opt_closers;
+	unsigned long locks, dirty;
+	double	lat;
+	int	type = 0;
+
+	if (me >= nslots)
+		return NULL;
+	if (opt_jitter)
+		jitter_init(opt_threads + (st - closers));
+
 	while (running) {
-		if (the_file >= 0)
-			close(the_file);
+		for (i = me; i < nslots && running; i += opt_closers) {
+			/* Cycle through the selected race types */
+			while (!(opt_races & (1 << type)))
+				type = (type + 1) % __RACE_MAX;
 
-		/* write(1, "/", 1); */
-		if ((the_file = open (opt_filename, O_RDWR|O_CREAT, 0600)) < 0)
-			perror(opt_filename);
+			if (slots[i].busy)
+				st->overlap[type]++;
+			locks = slots[i].locks;
+			dirty = slots[i].dirty;
+			lat = race(&slots[i], type);
+			st->race[type]++;
+			if (close_cost && lat >= 0) {
+				close_record(&close_cost[st - closers], locks, dirty, lat);
 
-		/* Keep the file open for a given amount of time. */
-		if (opt_opentime)
-			usleep(opt_opentime);
+				/* Every close flushes; closing a dup drops
+				 * POSIX locks, but not OFD locks */
+				if (type != RACE_DUP_CLOSE || opt_mode != MODE_OFD)
+					slots[i].locks = 0;
+				slots[i].dirty = 0;
+			}
+			type = (type + 1) % __RACE_MAX;
+
+			/* Keep the file open for a given amount of time. */
+			delay(opt_opentime);
+		}
 	}
 	return NULL;
 }
 
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report(const char *name, const struct stats *st, double elapsed)
+{
+	printf("%s: %8lu successful calls (%9.1f/sec), %8lu badfile (%9.1f/sec)",
+		name,
+		st->success, st->success / elapsed,
+		st->badfile, st->badfile / elapsed);
+	if (st->nolock)
+		printf(", %8lu nolock", st->nolock);
+	if (st->other)
+		printf(", %8lu errors", st->other);
+	printf("\n");
+}
+
+/*
+ * Upper bound of the latency bucket below which the given
+ * fraction of samples falls
+ */
+static unsigned long
+close_percentile(const struct close_cell *cell, double frac)
+{
+	unsigned long sum = 0;
+	unsigned int b;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		sum += cell->hist[b];
+		if (sum >= frac * cell->count)
+			break;
+	}
+	return 1UL << b;
+}
+
+static void
+close_report(unsigned int nclosers)
+{
+	static struct close_cell total[LOCK_BUCKETS][DIRTY_BUCKETS];
+	struct close_cell *cell, *src;
+	unsigned int i, l, d, b;
+
+	for (i = 0; i < nclosers; i++) {
+		for (l = 0; l < LOCK_BUCKETS; l++) {
+			for (d = 0; d < DIRTY_BUCKETS; d++) {
+				cell = &total[l][d];
+				src = &close_cost[i].cell[l][d];
+				cell->count += src->count;
+				cell->sum += src->sum;
+				if (src->max > cell->max)
+					cell->max = src->max;
+				for (b = 0; b < LAT_BUCKETS; b++)
+					cell->hist[b] += src->hist[b];
+			}
+		}
+	}
+
+	printf("Close latency (usec) by locks held and dirty data:\n");
+	printf("%9s %9s %9s %10s %8s %8s %10s\n",
+		"locks<", "dirty<", "count", "mean", "p50<=", "p99<=", "max");
+	for (l = 0; l < LOCK_BUCKETS; l++) {
+		for (d = 0; d < DIRTY_BUCKETS; d++) {
+			cell = &total[l][d];
+			if (cell->count == 0)
+				continue;
+			printf("%9lu %8luK %9lu %10.1f %8lu %8lu %10.1f\n",
+				1UL << l, 1UL << d,
+				cell->count, cell->sum / cell->count,
+				close_percentile(cell, 0.5),
+				close_percentile(cell, 0.99),
+				cell->max);
+		}
+	}
+}
+
 static void
 usage(int status)
 {
 	fprintf(stderr,
-		"Usage: lock-crasher [-t threadcount] [-w] pathname\n");
+		"Usage: lock-crasher [-t threadcount] [-d seconds] [-m threads|ofd|procs] [-w [-W msec]]\n"
+		"                    [-f files] [-c closers] [-r close,dup2,dup-close,close_range,exec]\n"
+		"                    [-j seed] [-s secs] [-l locks] [-D kbytes] pathname\n");
 	exit(status);
 }
 
+static int
+parse_races(char *list)
+{
+	char	*word;
+	int	type;
+
+	opt_races = 0;
+	for (word = strtok(list, ","); word; word = strtok(NULL, ",")) {
+		for (type = 0; type < __RACE_MAX; type++) {
+			if (!strcmp(word, race_name[type]))
+				break;
+		}
+		if (type == __RACE_MAX) {
+			fprintf(stderr, "Unknown race type \"%s\"\n", word);
+			return 0;
+		}
+#ifdef SYS_close_range
+		/* An empty range beyond all open files tells us whether
+		 * the kernel has it */
+		if (type == RACE_CLOSE_RANGE && syscall(SYS_close_range, ~0U, ~0U, 0) < 0) {
+#else
+		if (type == RACE_CLOSE_RANGE) {
+#endif
+			fprintf(stderr, "close_range is not supported\n");
+			return 0;
+		}
+		opt_races |= 1 << type;
+	}
+	return opt_races != 0;
+}
+
+/*
+ * Wait for the end of the run: after opt_duration, or once no new
+ * outcome sequences have turned up for opt_stall seconds.
+ * Returns 1 if we stopped early.
+ */
+static int
+wait_for_end(double start)
+{
+	double	t;
+
+	while (1) {
+		usleep(100000);
+		t = now();
+		if (t - start >= opt_duration)
+			return 0;
+		if (opt_stall && t - coverage->last_new >= opt_stall)
+			return 1;
+	}
+}
+
+/*
+ * Open the initial set of file descriptors
+ */
+static int
+open_slots(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nslots; i++) {
+		slots[i].file = i % opt_files;
+		slots[i].busy = 0;
+		slots[i].locks = 0;
+		slots[i].dirty = 0;
+		if ((slots[i].fd = open_file(slots[i].file)) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * In procs mode, every child runs a locker and close threads
+ * of its own, on its own set of file descriptors.
+ */
+static void
+child(unsigned int i)
+{
+	pthread_t	*close_thread;
+	unsigned int	c;
+
+	for (c = 0; c < nslots; c++)
+		close(slots[c].fd);
+	if (!open_slots())
+		exit(1);
+
+	close_thread = calloc(opt_closers, sizeof(pthread_t));
+	for (c = 0; c < opt_closers; c++)
+		pthread_create(&close_thread[c], NULL, open_close, &closers[i * opt_closers + c]);
+	lock_unlock(&stats[i]);
+	for (c = 0; c < opt_closers; c++)
+		pthread_join(close_thread[c], NULL);
+	exit(0);
+}
+
 int
 main(int argc, char** argv)
 {
 	struct sigaction act;
-	struct stats	stats[MAX_THREADS];
-	pthread_t	thread[MAX_THREADS];
-	pthread_t	close_thread;
-	int		i, c;
+	static struct stats total;
+	pthread_t	*thread = NULL;
+	pthread_t	*close_thread = NULL;
+	pid_t		*pid = NULL;
+	unsigned int	nclosers;
+	char		name[32];
+	double		start, elapsed;
+	int		i, c, status, early;
 
-	while ((c = getopt(argc, argv, "H:nO:t:w")) != -1) {
+	while ((c = getopt(argc, argv, "c:d:D:f:H:j:l:m:nO:r:s:t:wW:")) != -1) {
 		switch (c) {
+		case 'c':
+			opt_closers = atoi(optarg);
+			if (opt_closers == 0)
+				usage(1);
+			break;
+
+		case 'd':
+			opt_duration = atoi(optarg);
+			break;
+
+		case 'D':
+			opt_dirty = atoi(optarg);
+			if (opt_dirty > MAX_DIRTY)
+				usage(1);
+			break;
+
+		case 'f':
+			opt_files = atoi(optarg);
+			if (opt_files == 0)
+				usage(1);
+			break;
+
 		case 'H':
 			opt_holdtime = atoi(optarg) * 1000;
 			break;
 
+		case 'j':
+			opt_jitter = 1;
+			opt_seed = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			opt_locks = atoi(optarg);
+			if (opt_locks > MAX_LOCKS)
+				usage(1);
+			break;
+
+		case 'm':
+			if (!strcmp(optarg, "threads"))
+				opt_mode = MODE_THREADS;
+			else if (!strcmp(optarg, "ofd"))
+				opt_mode = MODE_OFD;
+			else if (!strcmp(optarg, "procs"))
+				opt_mode = MODE_PROCS;
+			else
+				usage(1);
+			break;
+
 		case 'n':
 			opt_noprogress = 1;
 			break;
@@ -211,20 +920,29 @@ main(int argc, char** argv)
 			opt_opentime = atoi(optarg) * 1000;
 			break;
 
+		case 'r':
+			if (!parse_races(optarg))
+				usage(1);
+			break;
+
+		case 's':
+			opt_stall = atoi(optarg);
+			break;
+
 		case 't':
 			opt_threads = atoi(optarg);
-			if (opt_threads > MAX_THREADS) {
-				fprintf(stderr,
-					"Too many threads (%u max)\n",
-					MAX_THREADS);
-				return 1;
-			}
+			if (opt_threads == 0)
+				usage(1);
 			break;
 
 		case 'w':
 			opt_lockwait = 1;
 			break;
 
+		case 'W':
+			opt_waittime = atoi(optarg);
+			break;
+
 		default:
 			usage(1);
 		}
@@ -240,38 +958,171 @@ main(int argc, char** argv)
 		perror("sigaction");
 		return 1;
 	}
+	act.sa_handler = stop;
+	if (sigaction (SIGUSR1, &act, NULL) < 0) {
+		perror("sigaction");
+		return 1;
+	}
+
+	/* The counters live in shared memory, so that the
+	 * children in procs mode can report back. */
+	nclosers = opt_closers;
+	if (opt_mode == MODE_PROCS)
+		nclosers *= opt_threads;
+	stats = mmap(NULL, (opt_threads + nclosers) * sizeof(struct stats),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	closers = stats + opt_threads;
 
-	the_file = open(opt_filename, O_RDWR | O_CREAT, 0600);
-	if (the_file < 0) {
-		perror(opt_filename);
+	coverage = mmap(NULL, sizeof(*coverage),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (coverage == MAP_FAILED) {
+		perror("mmap");
 		return 1;
 	}
 
-	printf("Starting lock threads ..."); fflush(stdout);
-	memset(stats, 0, sizeof(stats));
-	for (i = 0; i < opt_threads; i++)
-		pthread_create(&thread[i], NULL, lock_unlock, &stats[i]);
-	printf(" running ..."); fflush(stdout);
-	usleep(100000);
+	if (opt_locks || opt_dirty) {
+		/* Threads share one lock owner, so we could not
+		 * tell who holds which locks */
+		if (opt_mode == MODE_THREADS) {
+			fprintf(stderr, "-l and -D need -m ofd or -m procs\n");
+			return 1;
+		}
+		close_cost = mmap(NULL, nclosers * sizeof(struct close_cost),
+				PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (close_cost == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+	if (opt_dirty) {
+		if ((dirty_buf = malloc(opt_dirty * 1024)) == NULL) {
+			perror("malloc");
+			return 1;
+		}
+		memset(dirty_buf, 'x', opt_dirty * 1024);
+	}
 
-	pthread_create(&close_thread, NULL, open_close, NULL);
-	sleep(5);
+	files = calloc(opt_files, sizeof(char *));
+	for (i = 0; i < opt_files; i++) {
+		if (opt_files == 1) {
+			files[i] = opt_filename;
+		} else {
+			snprintf(name, sizeof(name), ".%u", i);
+			files[i] = malloc(strlen(opt_filename) + strlen(name) + 1);
+			sprintf(files[i], "%s%s", opt_filename, name);
+		}
+	}
 
-	running = 0;
-	for (i = 0; i < opt_threads; i++)
-		pthread_join(thread[i], NULL);
+	nslots = opt_files;
+	if (opt_mode == MODE_OFD)
+		nslots *= opt_threads;
+	if (posix_memalign((void **) &slots, CACHELINE, nslots * sizeof(struct slot))) {
+		perror("posix_memalign");
+		return 1;
+	}
+	if (!open_slots())
+		return 1;
+
+	if (opt_mode == MODE_PROCS) {
+		printf("Starting lock processes ..."); fflush(stdout);
+		pid = calloc(opt_threads, sizeof(pid_t));
+		if (pid == NULL) {
+			perror("calloc");
+			return 1;
+		}
+
+		start = coverage->last_new = now();
+		for (i = 0; i < opt_threads; i++) {
+			if ((pid[i] = fork()) < 0) {
+				perror("fork");
+				break;
+			}
+			if (pid[i] == 0)
+				child(i);
+		}
+		printf(" running ..."); fflush(stdout);
+		early = wait_for_end(start);
+
+		for (i = 0; i < opt_threads; i++) {
+			if (pid[i] > 0)
+				kill(pid[i], SIGUSR1);
+		}
+		for (i = 0; i < opt_threads; i++) {
+			if (pid[i] > 0 && waitpid(pid[i], &status, 0) > 0
+			 && (!WIFEXITED(status) || WEXITSTATUS(status)))
+				fprintf(stderr, "Process %u failed\n", i);
+		}
+		elapsed = now() - start;
+	} else {
+		thread = calloc(opt_threads, sizeof(pthread_t));
+		close_thread = calloc(opt_closers, sizeof(pthread_t));
+		if (thread == NULL || close_thread == NULL) {
+			perror("calloc");
+			return 1;
+		}
+
+		printf("Starting lock threads ..."); fflush(stdout);
+		start = coverage->last_new = now();
+		for (i = 0; i < opt_threads; i++)
+			pthread_create(&thread[i], NULL, lock_unlock, &stats[i]);
+		printf(" running ..."); fflush(stdout);
+		usleep(100000);
+
+		for (i = 0; i < opt_closers; i++)
+			pthread_create(&close_thread[i], NULL, open_close, &closers[i]);
+		early = wait_for_end(start);
+
+		running = 0;
+		for (i = 0; i < opt_threads; i++)
+			pthread_join(thread[i], NULL);
+		for (i = 0; i < opt_closers; i++)
+			pthread_join(close_thread[i], NULL);
+		elapsed = now() - start;
+	}
 
 	printf("done.\n");
 	for (i = 0; i < opt_threads; i++) {
-		printf("Thread %u: %8d successful calls, %8d badfile", i,
-			stats[i].success,
-			stats[i].badfile);
-		if (stats[i].nolock)
-			printf(", %8d nolock", stats[i].nolock);
-		if (stats[i].other)
-			printf(", %8d errors", stats[i].other);
-		printf("\n");
+		snprintf(name, sizeof(name), "%s %u",
+			(opt_mode == MODE_PROCS)? "Process" : "Thread", i);
+		report(name, &stats[i], elapsed);
+
+		total.success += stats[i].success;
+		total.nolock += stats[i].nolock;
+		total.badfile += stats[i].badfile;
+		total.other += stats[i].other;
+	}
+	report("Total", &total, elapsed);
+
+	for (i = 0; i < nclosers; i++) {
+		for (c = 0; c < __RACE_MAX; c++) {
+			total.race[c] += closers[i].race[c];
+			total.overlap[c] += closers[i].overlap[c];
+		}
 	}
+	for (c = 0; c < __RACE_MAX; c++) {
+		if (!(opt_races & (1 << c)))
+			continue;
+		printf("Race %-11s %8lu times (%9.1f/sec), %8lu while locking (%9.1f/sec)\n",
+			race_name[c],
+			total.race[c], total.race[c] / elapsed,
+			total.overlap[c], total.overlap[c] / elapsed);
+	}
+
+	if (close_cost)
+		close_report(nclosers);
+
+	printf("Coverage: %u of %u outcome sequences of length %u, last new one after %.1f sec\n",
+		coverage->count, NUM_SEQS, SEQ_LEN, coverage->last_new - start);
+	if (early)
+		printf("Stopped after %.1f sec, no new sequences for %u sec\n",
+			elapsed, opt_stall);
 
+	free(thread);
+	free(close_thread);
+	free(pid);
 	return 0;
 }
@@ -25,16 +25,157 @@
  *	lockbench -n $nt -f 64
  * done
  *
+ * or, without restarting lockbench and recreating the files each time,
+ *
+ *	lockbench -S 10:60:10 -f 64 -o csv
+ *
+ * which also tries to locate the knee of the throughput curve, and the
+ * point where it collapses. -S can sweep over the number of files and
+ * locks as well, e.g. "-S workers=1:64:*2,files=16:256:*2", and over
+ * the target rate of an open-loop run (see -r below).
+ *
  * You probably want to increase the number of files and locks
  * per file when testing with higher thread counts, otherwise you
  * will end up with processes getting blocked all the time on
- * conflicting locks.
+ * conflicting locks. Alternatively, use -p to assign a set of files
+ * or records to each process exclusively (see below).
+ *
+ * Every lock and unlock call is timed, and the latencies are collected
+ * in a log-linear histogram per process. The parent merges these and
+ * reports percentiles for acquire and release separately, because the
+ * average hides the occasional multi-second stall of the lock manager.
+ *
+ * The children report their progress through a shared memory region,
+ * with one counter per process. The parent samples these counters
+ * every second (see -i), so that grace period stalls or lockd hiccups
+ * show up in the output as they happen.
+ *
+ * The lock backend is selected with -B:
+ *   posix	classic fcntl record locks (the default)
+ *   ofd	open file description locks (F_OFD_SETLKW)
+ *   flock	whole-file flock() locks
+ *   lease	F_SETLEASE read leases on the whole file
+ * Several backends can be given, separated by commas; lockbench then
+ * runs the benchmark once for each of them. The kernel detects
+ * deadlocks only for POSIX locks, so with all other backends, workers
+ * drop all their locks and acquire the next batch in ascending order
+ * instead of replacing them one at a time. flock() cannot convert a
+ * lock atomically, and leases are always shared, so the upgrade and
+ * downgrade parts of the lock mix (-m) are ignored for these. Backends
+ * the files' file system does not support, such as leases on NFS, are
+ * skipped.
+ *
+ * Only granted locks count towards the ops/sec figure. Deadlocks
+ * reported by the kernel (EDEADLK), waits interrupted by a signal, and
+ * requests refused because the lock is busy (leases, and upgrades that
+ * must not block) are counted and timed separately, since they cost
+ * very different amounts of work. "-O sorted" makes POSIX workers
+ * acquire batches in ascending order as well, which never deadlocks,
+ * while "-O random" acquires batches in random order. Comparing the
+ * two shows the cost of deadlock detection. Random order needs a
+ * backend with deadlock detection.
+ *
+ * With -T, lockbench runs its workers as threads of a single process
+ * rather than forking. Classic POSIX locks do not conflict between
+ * threads, so in this mode every thread opens the files on its own and
+ * the backend defaults to OFD locks.
+ *
+ * Normally, lockbench is closed-loop: each worker asks for the next lock
+ * as soon as it got the previous one, so a slow server also slows down
+ * the load. With -r, requests are scheduled at a fixed aggregate rate
+ * instead, with constant or exponentially distributed (-a poisson)
+ * inter-arrival times. Every arrival is a single lock request, and a
+ * worker drops the lock it holds before it waits for its next arrival,
+ * so that the hold time does not grow as the rate goes down. The
+ * workers' schedules are staggered, so that the aggregate load is
+ * spread evenly over time. The "response" latency is then measured from
+ * the time a request was scheduled rather than the time it was issued,
+ * so that time spent waiting for the previous request is not lost.
+ *
+ * By default, all records are equally likely to be picked. Real lock
+ * traffic is usually skewed, so -d lets you select a Zipf distribution
+ * ("zipf:0.99") or a hotspot ("hotspot:90:10", i.e. 90% of all
+ * operations go to 10% of the records). Records are numbered across
+ * all files, so hot records are spread evenly over the files. Each
+ * worker draws from its own xorshift generator, seeded from -s, so
+ * runs are reproducible.
+ *
+ * The -m option controls the mix of lock operations. By default, every
+ * lock is a write lock of LOCKLEN bytes. The mix can specify
+ *   read=<pct>		percentage of read locks
+ *   upgrade=<pct>	chance that a read lock is upgraded in place
+ *   downgrade=<pct>	chance that a write lock is downgraded in place
+ *   overlap=<pct>	chance that a lock extends into the next record
+ *   len=<len>[*<weight>]/...	distribution of lock lengths
+ * for instance "read=70,upgrade=10,len=1*80/512*20". Records are spaced
+ * by the largest lock length. Results are reported per operation type.
+ *
+ * With -p, the benchmark can be run without any lock conflicts, to
+ * separate the cost of the client/server lock path from the cost of
+ * real contention. "-p files" gives each worker a set of files of its
+ * own, while "-p records" lets all workers share all files but gives
+ * each of them its own set of records. Overlapping locks would reach
+ * into records of other workers, so -p cannot be combined with overlap=.
+ * Backends that lock whole files (flock, lease) are skipped with
+ * "-p records".
+ *
+ * With -D dir1,dir2,..., the files are spread across several target
+ * directories, for instance different file systems exported by the same
+ * server, or several mounts of one export. File N goes to target
+ * N % ntargets. By default, every worker locks files in all targets.
+ * With -G, the workers are split into one group per target, and each
+ * group only locks files of its own target. The numbers of workers and
+ * files then need to be multiples of the number of targets. Results
+ * are reported per target as well as in aggregate.
+ *
+ * By default, every worker opens all files before it starts. With large
+ * file sets that quickly runs into the open file limit (and into NFSv4
+ * open state on the server), so -C can limit each worker to an LRU
+ * cache of N open files ("lru:N"), or make it open a file for every
+ * lock and close it on unlock ("per-lock"). A file is never closed while
+ * the worker holds a lock on it, as that would drop the lock. Opens and
+ * closes during the run are timed and reported.
+ *
+ * -H rounds[:msec] measures something else entirely: how quickly, and
+ * how fairly, a contended lock is handed over. The parent takes a write
+ * lock on the first record of the first file. All workers then block on
+ * it, and after msec (10 by default) the parent drops it. Every worker
+ * holds the lock just long enough to record when it got it, and passes
+ * it on. lockbench reports the wakeup latency (from the parent's unlock
+ * to the first grant), the handoff latency (from one unlock to the next
+ * grant), the grant order, and Jain's fairness index over all rounds,
+ * both for the number of first grants and for the time spent waiting.
+ *
+ * If the files live on NFS, lockbench takes a snapshot of the mount's
+ * per-op RPC statistics in /proc/self/mountstats once all workers have
+ * opened their files, and again as soon as they are told to stop, so
+ * that opening and closing the files is not included. It then reports
+ * how many RPCs were sent per lock operation, and their average round
+ * trip and execution time. With several targets (-D), every NFS mount
+ * among them is reported on its own, against the lock operations on
+ * its targets, followed by the total. Targets that are not on NFS are
+ * left out. This tells whether a regression is caused by the client
+ * (more RPCs) or by the server (slower RPCs). With NFSv4, locking
+ * shows up as LOCK, LOCKU and LOCKT. NFSv3 locks are handled by lockd,
+ * whose NLM calls are not accounted in mountstats, so there only the
+ * side traffic is visible. Use -v to see all RPC types.
  *
- * We could change the benchmark to assign a set of files to
- * one process exclusively. Not sure what netbench does.
+ * Workers normally float across all CPUs. -c pins worker N to a CPU,
+ * chosen from the CPUs we are allowed to run on, either round-robin in
+ * CPU number order ("rr"), filling up one NUMA node after the other
+ * ("compact"), or alternating between nodes ("spread"). The node layout
+ * is taken from sysfs. The placement is printed before the first run.
  */
+#define _GNU_SOURCE
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
@@ -42,51 +183,528 @@
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <ctype.h>
+#include <dirent.h>
 
 #define LOCKLEN		1
+#define MAX_TARGETS	8
 #define NUMCONCURRENT	16
+#define CACHELINE	64
+
+/*
+ * Latency histogram, in usec. Values below HIST_SUB_COUNT are recorded
+ * exactly; above that, every power of two is split into HIST_SUB_COUNT
+ * linear sub-buckets, which gives us a relative error of about 3%.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	32
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	max;
+	uint64_t	bucket[HIST_BUCKETS];
+};
+
+enum {
+	OP_RDLCK,
+	OP_WRLCK,
+	OP_UPGRADE,
+	OP_DOWNGRADE,
+	OP_UNLOCK,
+	OP_DEADLOCK,
+	OP_INTR,
+	OP_REFUSED,
+	OP_OPEN,
+	OP_CLOSE,
+
+	__OP_MAX
+};
+
+/*
+ * Per-process results, living in memory shared with the parent.
+ * The counter is sampled by the parent while the benchmark is running,
+ * so it gets a cache line of its own. Histograms that only some modes
+ * need are kept in a separate array, see worker_hists().
+ */
+struct worker {
+	volatile unsigned long	count __attribute__((aligned(CACHELINE)));
+	unsigned int		index;
+	volatile int		ready;
+	uint64_t		next_arrival;
+	int			cpu;
+	unsigned long		fd_lookups;
+	unsigned long		target_count[MAX_TARGETS];
+	unsigned long		target_lockops[MAX_TARGETS];
+
+	struct histogram	hist[__OP_MAX] __attribute__((aligned(CACHELINE)));
+	struct histogram	response;
+	struct histogram *	target_acquire;	/* with several targets */
+
+	/* Thundering herd mode */
+	unsigned long		herd_first, herd_last;
+	uint64_t		herd_rank_sum, herd_wait_sum;
+	struct histogram *	herd_wakeup;
+	struct histogram *	herd_handoff;
+};
+
+/*
+ * Round state of the thundering herd, shared between the holder
+ * and the waiters. Times are in nsec.
+ */
+struct herd {
+	volatile unsigned int	round;
+	volatile unsigned int	waiting;
+	volatile unsigned int	granted;
+	volatile uint64_t	start;
+	volatile uint64_t	release;
+};
+
+enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_HOTSPOT,
+};
+
+struct distribution {
+	int		type;
+	unsigned long	nrecords;
+
+	/* Zipf parameters, see Gray et al, "Quickly Generating
+	 * Billion-Record Synthetic Databases" */
+	double		theta;
+	double		zetan, eta, alpha, half_pow_theta;
+
+	/* Hotspot parameters */
+	double		hot_ops;
+	double		hot_records;
+	unsigned long	nhot;
+};
+
+struct rng {
+	uint64_t	state;
+};
+
+#define MAX_LENGTHS	16
+
+struct lockmix {
+	double		read;
+	double		upgrade;
+	double		downgrade;
+	double		overlap;
+
+	unsigned int	nlengths;
+	struct {
+		unsigned long	len;
+		double		weight;
+	}		length[MAX_LENGTHS];
+
+	/* Distance between records; the largest lock length */
+	unsigned long	stride;
+};
+
+enum {
+	PARTITION_NONE,
+	PARTITION_FILES,
+	PARTITION_RECORDS,
+};
+
+struct lock;
+
+struct backend {
+	const char *	name;
+	int		open_flags;
+	int		whole_file;	/* flock and leases ignore the byte range */
+	int		per_thread;	/* locks held by different threads conflict */
+	int		deadlock_detect;
+	int		shared_only;	/* no exclusive locks */
+	int		convert;	/* can change the lock type in place */
+
+	int		(*lock)(struct lock *, int type, int wait);
+	int		(*unlock)(struct lock *);
+};
+
+struct sweep_range {
+	int		from, to, step;
+	int		multiply;
+};
+
+struct sweep {
+	struct sweep_range workers, files, locks, rate;
+};
+
+struct sweep_result {
+	const char *	backend;
+	int		workers, files, locks;
+	int		target_rate;
+	unsigned long	count;
+	double		rate;
+	uint64_t	acquire_p50, acquire_p99, acquire_p999, acquire_max;
+	uint64_t	release_p99;
+	uint64_t	response_p50, response_p99, response_p999;
+	unsigned long	deadlocks, interrupts, refused;
+	double		rpcs_per_op, rpc_rtt, rpc_execute;
+	int		knee, collapse;
+};
+
+/*
+ * Per-op RPC counters of an NFS mount, as found in the "per-op
+ * statistics" section of /proc/self/mountstats. Times are in msec.
+ */
+#define MAX_RPC_OPS	80
+
+struct rpc_op {
+	char		name[24];
+	unsigned long	ops, trans, timeouts;
+	unsigned long	queue, rtt, execute;
+};
+
+struct mountstats {
+	unsigned int	nops;
+	struct rpc_op	op[MAX_RPC_OPS];
+};
+
+/* An NFS mount, and the targets (as a bitmap) that live on it */
+struct rpc_mount {
+	char *		path;
+	unsigned int	targets;
+	struct mountstats before, after;
+};
+
+#define COLLAPSE_PCT	20
+#define MAX_BACKENDS	4
+
+enum {
+	ORDER_DEFAULT,
+	ORDER_ROLLING,
+	ORDER_SORTED,
+	ORDER_RANDOM,
+};
+
+enum {
+	PLACE_NONE,
+	PLACE_RR,
+	PLACE_COMPACT,
+	PLACE_SPREAD,
+};
+
+static const char *	place_name[] = {
+	[PLACE_NONE]	= "none",
+	[PLACE_RR]	= "rr",
+	[PLACE_COMPACT]	= "compact",
+	[PLACE_SPREAD]	= "spread",
+};
+
+struct cpu {
+	int		cpu;
+	int		node;
+};
+
+enum {
+	ARRIVAL_CONSTANT,
+	ARRIVAL_POISSON,
+};
+
+enum {
+	FORMAT_NONE,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+enum {
+	FDCACHE_ALL,
+	FDCACHE_LRU,
+	FDCACHE_PER_LOCK,
+};
+
+/*
+ * Per-worker cache of open files. Files that are open but not locked
+ * sit on a doubly linked LRU list, indexed by file number.
+ */
+struct fdcache {
+	int *		fd;
+	unsigned int *	refs;
+	int *		prev;
+	int *		next;
+	int		head, tail;
+	unsigned int	nopen;
+};
+
+struct lock {
+	int		fd;
+	int		file;
+	struct flock	fl;
+};
 
 static const char *	opt_basename = "locktest";
 static int		opt_timeout = 60;
 static int		opt_threads = 40;
 static int		opt_files = 4;
 static int		opt_locks = 128;
+static int		opt_interval = 1;
+static int		opt_verbose = 0;
+static int		opt_pthreads = 0;
+static int		opt_order = ORDER_DEFAULT;
+static int		opt_fdcache = FDCACHE_ALL;
+static unsigned int	opt_fdcache_size;
+static int		opt_grouped = 0;
+static char *		targets[MAX_TARGETS];
+static unsigned int	ntargets;
+static unsigned int	opt_herd = 0;
+static unsigned int	opt_herd_hold = 10;
+static struct herd *	herd;
+static struct histogram *extra_hist;
+static unsigned int	nextra_hist;
+static int		lock_order;
+static const struct backend *opt_backend;
+static const struct backend *opt_backends[MAX_BACKENDS];
+static unsigned int	opt_nbackends = 0;
+static int		opt_rate = 0;
+static int		opt_arrival = ARRIVAL_CONSTANT;
+static int		opt_placement = PLACE_NONE;
+
+static struct cpu *	cpus;
+static int		ncpus, nnodes, max_node;
+
+static struct rpc_mount	rpc_mounts[MAX_TARGETS];
+static unsigned int	nrpc_mounts;
+static int		rpc_valid;
+static uint64_t		opt_seed = 1;
+static struct distribution opt_dist = { .type = DIST_UNIFORM };
+static struct lockmix	opt_mix;
+static int		opt_partition = PARTITION_NONE;
+static struct sweep	opt_sweep;
+static int		opt_format = FORMAT_NONE;
+static const char *	opt_output = NULL;
 static char		**files;
 
-static void		run(void);
+static volatile int	running = 0;
+static pthread_barrier_t start_barrier;
+static sigset_t		start_mask;
+
+static int		bench(struct worker *);
+static int		run_step(struct worker *, struct sweep_result *);
+static int		setup_distribution(void);
+static void		run(struct worker *);
+static void *		run_thread(void *);
+static void		sample(struct worker *);
 static void		toggle_run(int);
 static void		usage(int);
+static int		dist_parse(struct distribution *, const char *);
+static void		dist_init(struct distribution *, unsigned long);
+static int		mix_parse(struct lockmix *, char *);
+static void		mix_init(struct lockmix *);
+static void		hist_merge(struct histogram *, const struct histogram *);
+static void		worker_hists(struct worker *, struct histogram *);
+static void		hist_report(const char *, const struct histogram *);
+static void		report(const struct worker *);
+static uint64_t		hist_percentile(const struct histogram *, double);
+static int		sweep_parse(struct sweep *, char *);
+static void		sweep_default(struct sweep_range *, int);
+static int		sweep_next(const struct sweep_range *, int);
+static int		sweep_max(const struct sweep_range *);
+static unsigned int	sweep_count(const struct sweep_range *);
+static int		sweeping(void);
+static void		sweep_record(struct sweep_result *, const struct worker *);
+static void		sweep_analyze(struct sweep_result *, unsigned int);
+static int		write_results(const struct sweep_result *, unsigned int);
+static void		wait_for_start(struct worker *);
+static const struct backend *backend_find(const char *);
+static int		backend_select(const struct backend *);
+static int		herd_lost(void);
+static int		herd_hold(void);
+static void		herd_wait(struct worker *);
+static void		herd_report(const struct worker *, const struct worker *);
+static int		targets_parse(char *);
+static void		targets_report(const struct worker *);
+static int		worker_uses_file(const struct worker *, int);
+static int		fdcache_parse(const char *);
+static int		fdcache_get(struct worker *, struct fdcache *, int);
+static void		fdcache_put(struct worker *, struct fdcache *, int);
+static int		placement_parse(const char *);
+static int		placement_init(void);
+static int		placement_cpu(unsigned int);
+static void		placement_pin(const struct worker *);
+static void		mountstats_find(void);
+static int		mountstats_read(const char *, struct mountstats *);
+static void		mountstats_start(void);
+static void		mountstats_stop(void);
+static void		mountstats_report(const struct worker *, struct sweep_result *);
 
 int
 main(int argc, char **argv)
 {
-	unsigned long total;
-	pid_t	pgrp, *pid;
-	int	*rfd;
+	struct sweep_result *results, *res;
+	struct sigaction act;
+	struct worker *worker;
+	unsigned int nresults = 0, nsteps = 0, group, nb;
+	int	max_threads, max_files, max_locks;
+	int	nf, nl, nr, nt;
+	int	failed = 0;
+	char	*name;
 	int	n, c;
 
-	while ((c = getopt(argc, argv, "b:f:l:n:t:")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:B:c:C:d:D:f:GH:i:l:m:n:o:O:p:r:s:S:t:Tv")) != -1) {
 		switch (c) {
+		case 'a':
+			if (!strcmp(optarg, "constant"))
+				opt_arrival = ARRIVAL_CONSTANT;
+			else if (!strcmp(optarg, "poisson"))
+				opt_arrival = ARRIVAL_POISSON;
+			else {
+				fprintf(stderr, "Bad arrival process \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
 		case 'b':
 			opt_basename = optarg;
 			break;
 
+		case 'B':
+			opt_nbackends = 0;
+			while ((name = strsep(&optarg, ",")) != NULL) {
+				if (opt_nbackends >= MAX_BACKENDS
+				 || !(opt_backends[opt_nbackends++] = backend_find(name))) {
+					fprintf(stderr, "Bad lock backend \"%s\"\n", name);
+					usage(1);
+				}
+			}
+			break;
+
+		case 'c':
+			if ((opt_placement = placement_parse(optarg)) < 0) {
+				fprintf(stderr, "Bad CPU placement \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'C':
+			if (!fdcache_parse(optarg)) {
+				fprintf(stderr, "Bad fd cache policy \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'd':
+			if (!dist_parse(&opt_dist, optarg)) {
+				fprintf(stderr, "Bad distribution \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'D':
+			if (!targets_parse(optarg)) {
+				fprintf(stderr, "Bad list of target directories \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'G':
+			opt_grouped = 1;
+			break;
+
+		case 'H':
+			opt_herd = strtoul(optarg, &name, 0);
+			if (*name == ':')
+				opt_herd_hold = strtoul(name + 1, &name, 0);
+			if (*name || opt_herd == 0) {
+				fprintf(stderr, "Bad thundering herd spec \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
 		case 'f':
 			opt_files = strtoul(optarg, NULL, 0);
 			break;
 
+		case 'i':
+			opt_interval = strtoul(optarg, NULL, 0);
+			break;
+
 		case 'l':
 			opt_locks = strtoul(optarg, NULL, 0);
 			break;
 
+		case 'm':
+			if (!mix_parse(&opt_mix, optarg)) {
+				fprintf(stderr, "Bad lock mix \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
 		case 'n':
 			opt_threads = strtoul(optarg, NULL, 0);
 			break;
 
+		case 'o':
+			if (!strncmp(optarg, "csv", 3))
+				opt_format = FORMAT_CSV;
+			else if (!strncmp(optarg, "json", 4))
+				opt_format = FORMAT_JSON;
+			else {
+				fprintf(stderr, "Bad output format \"%s\"\n", optarg);
+				usage(1);
+			}
+			if ((opt_output = strchr(optarg, ':')) != NULL)
+				opt_output++;
+			break;
+
+		case 'O':
+			if (!strcmp(optarg, "sorted"))
+				opt_order = ORDER_SORTED;
+			else if (!strcmp(optarg, "random"))
+				opt_order = ORDER_RANDOM;
+			else {
+				fprintf(stderr, "Bad lock order \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'p':
+			if (!strcmp(optarg, "files"))
+				opt_partition = PARTITION_FILES;
+			else if (!strcmp(optarg, "records"))
+				opt_partition = PARTITION_RECORDS;
+			else if (!strcmp(optarg, "none"))
+				opt_partition = PARTITION_NONE;
+			else {
+				fprintf(stderr, "Bad partitioning \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
+		case 'r':
+			opt_rate = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			opt_seed = strtoull(optarg, NULL, 0);
+			break;
+
+		case 'S':
+			if (!sweep_parse(&opt_sweep, optarg)) {
+				fprintf(stderr, "Bad sweep \"%s\"\n", optarg);
+				usage(1);
+			}
+			break;
+
 		case 't':
 			opt_timeout = strtoul(optarg, NULL, 0);
 			break;
 
+		case 'T':
+			opt_pthreads = 1;
+			break;
+
+		case 'v':
+			opt_verbose = 1;
+			break;
+
 		default:
 			usage(1);
 			return 1;
@@ -95,12 +713,43 @@ main(int argc, char **argv)
 	if (optind != argc)
 		usage(1);
 
-	files = (char **) calloc(opt_files, sizeof(char *));
-	for (n = 0; n < opt_files; ++n) {
+	mix_init(&opt_mix);
+
+	if (opt_partition != PARTITION_NONE && opt_mix.overlap) {
+		fprintf(stderr, "Overlapping locks cannot be used with -p\n");
+		usage(1);
+	}
+
+	if (opt_nbackends == 0) {
+		opt_backends[0] = backend_find(opt_pthreads? "ofd" : "posix");
+		opt_nbackends = 1;
+	}
+
+	if (ntargets == 0)
+		targets[ntargets++] = NULL;
+
+	/* Without -S, every dimension has just the one value
+	 * given on the command line. */
+	sweep_default(&opt_sweep.workers, opt_threads);
+	sweep_default(&opt_sweep.files, opt_files);
+	sweep_default(&opt_sweep.locks, opt_locks);
+	sweep_default(&opt_sweep.rate, opt_rate);
+
+	max_threads = sweep_max(&opt_sweep.workers);
+	max_files = sweep_max(&opt_sweep.files);
+	max_locks = sweep_max(&opt_sweep.locks);
+
+	/* Create the files once, for the largest step of the sweep */
+	files = (char **) calloc(max_files, sizeof(char *));
+	for (n = 0; n < max_files; ++n) {
 		char	namebuf[4096];
 		int	fd;
 
-		sprintf(namebuf, "%s.%d", opt_basename, n);
+		if (targets[n % ntargets])
+			snprintf(namebuf, sizeof(namebuf), "%s/%s.%d",
+					targets[n % ntargets], opt_basename, n);
+		else
+			snprintf(namebuf, sizeof(namebuf), "%s.%d", opt_basename, n);
 		files[n] = strdup(namebuf);
 
 		fd = open(namebuf, O_CREAT|O_TRUNC|O_RDWR, 0644);
@@ -109,61 +758,342 @@ main(int argc, char **argv)
 			return 1;
 		}
 
-		if (ftruncate(fd, opt_locks * LOCKLEN) < 0) {
+		if (ftruncate(fd, max_locks * opt_mix.stride) < 0) {
 			perror("ftruncate");
 			return 1;
 		}
 		close(fd);
 	}
 
+	if (ntargets > 1) {
+		printf("%u targets, %s:", ntargets,
+				opt_grouped? "one group of workers each" : "interleaved");
+		for (n = 0; n < ntargets; ++n)
+			printf(" %s", targets[n]);
+		printf("\n");
+	}
+
+	mountstats_find();
+
+	if (opt_placement != PLACE_NONE) {
+		if (!placement_init())
+			return 1;
+
+		printf("placement: %s, %d cpus on %d node%s\n",
+				place_name[opt_placement], ncpus, nnodes,
+				nnodes == 1? "" : "s");
+		for (n = 0; n < max_threads; ++n)
+			printf("%s%d:%d/%d%s", (n % 8)? " " : "  worker:cpu/node ",
+					n, placement_cpu(n), cpus[n % ncpus].node,
+					(n % 8 == 7 || n + 1 == max_threads)? "\n" : "");
+	}
+
 	if (setpgrp() < 0) {
 		perror("setpgrp");
 		return 1;
 	}
-	pgrp = getpgrp();
 
-	signal(SIGUSR1, toggle_run);
+	/* No SA_RESTART: the stop signal must interrupt blocked lock
+	 * requests, so that they get counted as interrupted. */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = toggle_run;
+	if (sigaction(SIGUSR1, &act, NULL) < 0) {
+		perror("sigaction");
+		return 1;
+	}
 
-	pid = (pid_t *) calloc(opt_threads, sizeof(pid_t));
-	rfd = (int *) calloc(opt_threads, sizeof(int));
+	worker = mmap(NULL, max_threads * sizeof(struct worker),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (worker == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (opt_herd) {
+		herd = mmap(NULL, sizeof(*herd),
+				PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (herd == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+
+	/* Only pay for the per-target and herd histograms when we use them */
+	nextra_hist = (ntargets > 1? ntargets : 0) + (opt_herd? 2 : 0);
+	if (nextra_hist) {
+		extra_hist = mmap(NULL, max_threads * nextra_hist * sizeof(struct histogram),
+				PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (extra_hist == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+	}
+
+	results = (struct sweep_result *) calloc(opt_nbackends
+			* sweep_count(&opt_sweep.workers)
+			* sweep_count(&opt_sweep.rate)
+			* sweep_count(&opt_sweep.files)
+			* sweep_count(&opt_sweep.locks), sizeof(*results));
+
+	for (nb = 0; nb < opt_nbackends && !failed; ++nb) {
+		if (!backend_select(opt_backends[nb]))
+			continue;
+
+		for (nf = opt_sweep.files.from; nf <= opt_sweep.files.to && !failed;
+		     nf = sweep_next(&opt_sweep.files, nf)) {
+			for (nl = opt_sweep.locks.from; nl <= opt_sweep.locks.to && !failed;
+			     nl = sweep_next(&opt_sweep.locks, nl)) {
+				for (nr = opt_sweep.rate.from; nr <= opt_sweep.rate.to && !failed;
+				     nr = sweep_next(&opt_sweep.rate, nr)) {
+					group = nresults;
+					for (nt = opt_sweep.workers.from; nt <= opt_sweep.workers.to;
+					     nt = sweep_next(&opt_sweep.workers, nt)) {
+						opt_threads = nt;
+						opt_files = nf;
+						opt_locks = nl;
+						opt_rate = nr;
+
+						n = run_step(worker, &results[nresults]);
+						if (n < 0) {
+							failed = 1;
+							break;
+						}
+						nsteps += n;
+						if (!opt_herd)
+							nresults += n;
+					}
+					sweep_analyze(results + group, nresults - group);
+				}
+			}
+		}
+	}
+
+	if (!failed && nsteps == 0) {
+		fprintf(stderr, "Nothing could be run with these options\n");
+		failed = 1;
+	}
+
+	if (sweeping()) {
+		for (n = 0; n < nresults; ++n) {
+			res = &results[n];
+			if (res->knee)
+				printf("%s, %d files, %d locks: knee at %d workers (%.2f ops/sec)\n",
+						res->backend, res->files, res->locks,
+						res->workers, res->rate);
+			if (res->collapse)
+				printf("%s, %d files, %d locks: collapse at %d workers (%.2f ops/sec)\n",
+						res->backend, res->files, res->locks,
+						res->workers, res->rate);
+		}
+	}
+
+	/* If a step failed, still write what we have so far */
+	if (opt_format != FORMAT_NONE && !write_results(results, nresults))
+		return 1;
+	return failed;
+}
+
+/*
+ * Run one step of the sweep: set it up, run the benchmark, and report
+ * and record the results in res (except for herd runs, which have their
+ * own report). Returns 1 if the step was run, 0 if a sweep step was
+ * skipped, or -1 if the benchmark failed or cannot be set up.
+ */
+static int
+run_step(struct worker *worker, struct sweep_result *res)
+{
+	static struct histogram total_extra[MAX_TARGETS + 2];
+	static struct worker total;
+	int	n, c;
+
+	if (sweeping())
+		printf("*** %s: %d workers, %d files, %d locks\n",
+				opt_backend->name, opt_threads, opt_files, opt_locks);
+	if (opt_rate)
+		printf("*** target rate %d ops/sec, %s arrivals\n", opt_rate,
+				opt_arrival == ARRIVAL_POISSON? "poisson" : "constant");
+	/* Within a sweep, other steps may still work out */
+	if (!setup_distribution())
+		return sweeping()? 0 : -1;
+
+	memset(worker, 0, opt_threads * sizeof(struct worker));
+	if (nextra_hist)
+		memset(extra_hist, 0, opt_threads * nextra_hist * sizeof(struct histogram));
 	for (n = 0; n < opt_threads; ++n) {
-		int	fd[2];
+		worker[n].index = n;
+		worker[n].cpu = placement_cpu(n);
+		worker_hists(&worker[n], extra_hist + n * nextra_hist);
+	}
 
-		if (pipe(fd) < 0) {
-			perror("pipe");
-			goto killall;
+	if (bench(worker) < 0)
+		return -1;
+
+	memset(&total, 0, sizeof(total));
+	memset(total_extra, 0, sizeof(total_extra));
+	worker_hists(&total, total_extra);
+	for (n = 0; n < opt_threads; ++n) {
+		struct worker *w = &worker[n];
+
+		total.count += w->count;
+		total.fd_lookups += w->fd_lookups;
+		for (c = 0; c < ntargets; ++c) {
+			total.target_count[c] += w->target_count[c];
+			total.target_lockops[c] += w->target_lockops[c];
+			if (w->target_acquire)
+				hist_merge(&total.target_acquire[c], &w->target_acquire[c]);
+		}
+		for (c = 0; c < __OP_MAX; ++c)
+			hist_merge(&total.hist[c], &w->hist[c]);
+		hist_merge(&total.response, &w->response);
+		if (opt_herd) {
+			hist_merge(total.herd_wakeup, w->herd_wakeup);
+			hist_merge(total.herd_handoff, w->herd_handoff);
+		}
+	}
+
+	if (opt_herd) {
+		herd_report(worker, &total);
+		return 1;
+	}
+
+	printf("locktest: %lu lock operations, %9.2f ops/sec\n",
+			total.count, (double) total.count / opt_timeout);
+	report(&total);
+	if (ntargets > 1)
+		targets_report(&total);
+
+	res->backend = opt_backend->name;
+	res->workers = opt_threads;
+	res->files = opt_files;
+	res->locks = opt_locks;
+	res->target_rate = opt_rate;
+	sweep_record(res, &total);
+	if (rpc_valid)
+		mountstats_report(&total, res);
+	return 1;
+}
+
+/*
+ * Run one step of the benchmark, with opt_threads workers
+ */
+static int
+bench(struct worker *worker)
+{
+	pid_t	pgrp = getpgrp(), *pid;
+	sigset_t mask;
+	int	n, status, failed = 0;
+
+	if (opt_pthreads) {
+		pthread_attr_t attr;
+		pthread_t *thread;
+		struct rlimit rlim;
+
+		/* All threads open their own copies of all files */
+		if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+			rlim.rlim_cur = rlim.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rlim);
 		}
+
+		/* Keep the stacks small so we can run thousands of threads */
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, 256 * 1024);
+		pthread_barrier_init(&start_barrier, NULL, opt_threads + 1);
+
+		thread = (pthread_t *) calloc(opt_threads, sizeof(pthread_t));
+		for (n = 0; n < opt_threads; ++n) {
+			int	err;
+
+			err = pthread_create(&thread[n], &attr, run_thread, &worker[n]);
+			if (err) {
+				fprintf(stderr, "pthread_create: %s\n", strerror(err));
+				exit(1);
+			}
+		}
+		pthread_attr_destroy(&attr);
+
+		/* Wait for all threads to open their files */
+		for (n = 0; n < opt_threads; ) {
+			if (worker[n].ready)
+				n++;
+			else
+				usleep(1000);
+		}
+		mountstats_start();
+
+		running = 1;
+		pthread_barrier_wait(&start_barrier);
+
+		if (opt_herd)
+			herd_hold();
+		else
+			sample(worker);
+		running = 0;
+		mountstats_stop();
+
+		for (n = 0; n < opt_threads; ++n)
+			pthread_join(thread[n], NULL);
+		pthread_barrier_destroy(&start_barrier);
+		free(thread);
+		return 0;
+	}
+
+	/* Keep SIGUSR1 blocked until the children are ready to receive it,
+	 * see wait_for_start() */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, &start_mask);
+	sigdelset(&start_mask, SIGUSR1);
+
+	/* Don't let the children inherit buffered output */
+	fflush(stdout);
+
+	pid = (pid_t *) calloc(opt_threads, sizeof(pid_t));
+	for (n = 0; n < opt_threads; ++n) {
 		pid[n] = fork();
 		if (pid[n] < 0) {
 			perror("fork");
 			goto killall;
 		}
 		if (pid[n] == 0) {
-			close(fd[0]);
-			dup2(fd[1], 1);
-			run();
+			if (opt_herd)
+				herd_wait(&worker[n]);
+			else
+				run(&worker[n]);
 			exit(0);
 		}
+	}
 
-		close(fd[1]);
-		rfd[n] = fd[0];
+	/* Wait for all children to open their files */
+	for (n = 0; n < opt_threads; ) {
+		if (worker[n].ready) {
+			n++;
+			continue;
+		}
+		if (waitpid(-1, &status, WNOHANG) > 0) {
+			fprintf(stderr, "*** Process exited prematurely ***\n");
+			goto killall;
+		}
+		usleep(1000);
 	}
-	
-	sleep(1);
+
+	mountstats_start();
 	kill(-pgrp, SIGUSR1);
 
-	sleep(opt_timeout);
+	if (opt_herd)
+		failed = herd_hold() < 0;
+	else
+		sample(worker);
 	kill(-pgrp, SIGUSR1);
+	mountstats_stop();
+	if (failed)
+		goto killall;
 
-	total = 0;
 	for (n = 0; n < opt_threads; ++n) {
-		char	buffer[64];
-		int	status, k = 0, cnt;
-
 		if (waitpid(pid[n], &status, 0) < 0) {
 			perror("waitpid");
 			goto killall;
 		}
+		pid[n] = 0;
 		if (!WIFEXITED(status)) {
 			fprintf(stderr, "*** Process %d crashed ***\n", n);
 			goto killall;
@@ -173,119 +1103,2172 @@ main(int argc, char **argv)
 					n, WEXITSTATUS(status));
 			goto killall;
 		}
-
-		while ((cnt = read(rfd[n], buffer+k, sizeof(buffer)-k)) > 0)
-			k += cnt;
-		if (cnt < 0) {
-			perror("read from pipe");
-			goto killall;
-		}
-		if (k == 0) {
-			fprintf(stderr, "*** No data from child %d ***\n", n);
-			goto killall;
-		}
-		buffer[k] = '\0';
-		total += strtoul(buffer, NULL, 0);
 	}
 
-	printf("locktest: %lu lock operations, %9.2f ops/sec\n",
-			total, (double) total / opt_timeout);
+	free(pid);
 	return 0;
 
 killall:
 	for (n = 0; n < opt_threads; ++n) {
-		if (pid[n] == 0)
+		if (pid[n] <= 0)
 			continue;
 		kill(pid[n], SIGKILL);
 	}
-	return 1;
-}
-
-static int	running = 0;
-
-void
-toggle_run(int sig)
-{
-	running = !running;
+	return -1;
 }
 
-void
-run(void)
+/*
+ * Set up the access distribution for the current number of
+ * workers, files and locks
+ */
+static int
+setup_distribution(void)
 {
-	struct lock {
-		int	fd;
-		struct flock fl;
-	}		lock[NUMCONCURRENT];
-	unsigned long	count = 0;
-	int		n, *fd;
+	unsigned int groups = opt_grouped? ntargets : 1;
+	int	threads, nfiles;
 
-	fd = (int *) calloc(opt_files, sizeof(int));
-	if (fd == NULL) {
-		perror("calloc");
-		exit(1);
+	/* With -G, each group of workers sees only the files
+	 * of its own target. */
+	if (opt_threads % groups || opt_files % groups) {
+		fprintf(stderr, "Need a multiple of %u workers and files with -G\n", groups);
+		return 0;
 	}
+	threads = opt_threads / groups;
+	nfiles = opt_files / groups;
 
-	for (n = 0; n < opt_files; ++n) {
-		fd[n] = open(files[n], O_RDWR);
-		if (fd[n] < 0) {
-			perror(files[n]);
-			exit(1);
-		}
-	}
+	switch (opt_partition) {
+	case PARTITION_NONE:
+		dist_init(&opt_dist, (unsigned long) nfiles * opt_locks);
+		break;
 
-	for (n = 0; n < NUMCONCURRENT; ++n)
-		lock[n].fd = -1;
+	case PARTITION_FILES:
+		if (nfiles < threads) {
+			if (groups > 1)
+				fprintf(stderr, "Need at least one file per worker, %d files "
+						"for the %d workers of each target (-f %d)\n",
+						threads, threads, threads * groups);
+			else
+				fprintf(stderr, "Need at least one file per worker (-f %d)\n", threads);
+			return 0;
+		}
+		dist_init(&opt_dist, (unsigned long) (nfiles / threads) * opt_locks);
+		break;
 
-	srand(getpid());
+	case PARTITION_RECORDS:
+		if ((unsigned long) nfiles * opt_locks < threads) {
+			fprintf(stderr, "Need at least one record per worker\n");
+			return 0;
+		}
+		dist_init(&opt_dist, (unsigned long) nfiles * opt_locks / threads);
+		break;
+	}
+	return 1;
+}
 
-	pause();
+/*
+ * Sweep ranges are given as from[:to[:step]], where a step of "*N"
+ * multiplies rather than adds.
+ */
+static int
+sweep_parse_range(struct sweep_range *range, const char *spec)
+{
+	char	*end;
 
-	while (running) {
-		struct lock *lk;
-		int	rnd, nf, nl;
-
-		for (n = 0, lk = lock; n < NUMCONCURRENT; ++n, ++lk) {
-			if (lk->fd != -1) {
-				lk->fl.l_type = F_UNLCK;
-				if (fcntl(lk->fd, F_SETLK, &lk->fl) < 0) {
-					perror("unlock");
-					exit(1);
-				}
-				lk->fd = -1;
+	range->from = range->to = strtoul(spec, &end, 0);
+	range->step = 1;
+	range->multiply = 0;
+	if (*end == ':') {
+		range->to = strtoul(end + 1, &end, 0);
+		if (*end == ':') {
+			if (end[1] == '*') {
+				range->multiply = 1;
+				end++;
 			}
+			range->step = strtoul(end + 1, &end, 0);
+		}
+	}
 
-			rnd = rand();
-			nf = rnd % opt_files;
-			nl = (rnd / opt_files) % opt_locks;
-
-			lk->fd = fd[rnd % opt_files];
-			lk->fl.l_type = F_WRLCK;
-			lk->fl.l_start = LOCKLEN * ((rnd / opt_files) % opt_locks);
-			lk->fl.l_len = LOCKLEN;
-			lk->fl.l_whence = SEEK_SET;
+	if (*end || range->from <= 0 || range->to < range->from)
+		return 0;
+	if (range->multiply? range->step < 2 : range->step < 1)
+		return 0;
+	return 1;
+}
 
-			if (fcntl(lk->fd, F_SETLKW, &lk->fl) < 0) {
-				lk->fd = -1; /* not locked */
-				switch (errno) {
-				case EINTR:
-					continue;
+/*
+ * Parse a sweep specification: either a range of worker counts, or a
+ * comma separated list of workers=<range>, files=<range>, locks=<range>,
+ * rate=<range>
+ */
+int
+sweep_parse(struct sweep *sweep, char *spec)
+{
+	char	*word, *value;
+
+	if (isdigit(*spec))
+		return sweep_parse_range(&sweep->workers, spec);
+
+	while ((word = strsep(&spec, ",")) != NULL) {
+		struct sweep_range *range;
+
+		if (!(value = strchr(word, '=')))
+			return 0;
+		*value++ = '\0';
+
+		if (!strcmp(word, "workers"))
+			range = &sweep->workers;
+		else if (!strcmp(word, "files"))
+			range = &sweep->files;
+		else if (!strcmp(word, "locks"))
+			range = &sweep->locks;
+		else if (!strcmp(word, "rate"))
+			range = &sweep->rate;
+		else
+			return 0;
+
+		if (!sweep_parse_range(range, value))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+sweep_default(struct sweep_range *range, int value)
+{
+	if (range->from == 0) {
+		range->from = range->to = value;
+		range->step = 1;
+	}
+}
+
+static int
+sweep_next(const struct sweep_range *range, int value)
+{
+	if (range->multiply)
+		return value * range->step;
+	return value + range->step;
+}
+
+static int
+sweep_max(const struct sweep_range *range)
+{
+	int	value, max = range->from;
+
+	for (value = range->from; value <= range->to; value = sweep_next(range, value))
+		max = value;
+	return max;
+}
+
+static unsigned int
+sweep_count(const struct sweep_range *range)
+{
+	unsigned int count = 0;
+	int	value;
+
+	for (value = range->from; value <= range->to; value = sweep_next(range, value))
+		count++;
+	return count;
+}
+
+static int
+sweeping(void)
+{
+	return opt_nbackends > 1
+	    || opt_sweep.workers.from != opt_sweep.workers.to
+	    || opt_sweep.files.from != opt_sweep.files.to
+	    || opt_sweep.locks.from != opt_sweep.locks.to
+	    || opt_sweep.rate.from != opt_sweep.rate.to;
+}
+
+static void
+sweep_record(struct sweep_result *res, const struct worker *total)
+{
+	static struct histogram acquire;
+
+	memset(&acquire, 0, sizeof(acquire));
+	hist_merge(&acquire, &total->hist[OP_RDLCK]);
+	hist_merge(&acquire, &total->hist[OP_WRLCK]);
+
+	res->count = total->count;
+	res->rate = (double) total->count / opt_timeout;
+	res->acquire_p50 = hist_percentile(&acquire, 50);
+	res->acquire_p99 = hist_percentile(&acquire, 99);
+	res->acquire_p999 = hist_percentile(&acquire, 99.9);
+	res->acquire_max = acquire.max;
+	res->release_p99 = hist_percentile(&total->hist[OP_UNLOCK], 99);
+	res->response_p50 = hist_percentile(&total->response, 50);
+	res->response_p99 = hist_percentile(&total->response, 99);
+	res->response_p999 = hist_percentile(&total->response, 99.9);
+	res->deadlocks = total->hist[OP_DEADLOCK].count;
+	res->interrupts = total->hist[OP_INTR].count;
+	res->refused = total->hist[OP_REFUSED].count;
+}
+
+/*
+ * Given the results for increasing worker counts, find the knee of the
+ * throughput curve and the point where it collapses.
+ *
+ * The knee is found like Kneedle does: normalize both axes up to the
+ * peak throughput, and pick the point that is furthest above the
+ * diagonal. Throughput has collapsed when it drops more than
+ * COLLAPSE_PCT percent below the peak.
+ */
+static void
+sweep_analyze(struct sweep_result *res, unsigned int count)
+{
+	double	ymin, ymax, best = 0;
+	unsigned int i, peak = 0, knee = 0;
+
+	if (count < 3)
+		return;
+
+	for (i = 1; i < count; ++i) {
+		if (res[i].rate > res[peak].rate)
+			peak = i;
+	}
+
+	if (peak >= 2) {
+		ymin = ymax = res[0].rate;
+		for (i = 0; i <= peak; ++i) {
+			if (res[i].rate < ymin)
+				ymin = res[i].rate;
+			if (res[i].rate > ymax)
+				ymax = res[i].rate;
+		}
+
+		for (i = 1; i < peak && ymax > ymin; ++i) {
+			double x, y;
+
+			x = (double) (res[i].workers - res[0].workers)
+			  / (res[peak].workers - res[0].workers);
+			y = (res[i].rate - ymin) / (ymax - ymin);
+			if (y - x > best) {
+				best = y - x;
+				knee = i;
+			}
+		}
+	}
+
+	/* If the curve is concave all the way, the peak is the knee */
+	res[knee? knee : peak].knee = 1;
+
+	for (i = peak + 1; i < count; ++i) {
+		if (res[i].rate < res[peak].rate * (100 - COLLAPSE_PCT) / 100) {
+			res[i].collapse = 1;
+			break;
+		}
+	}
+}
+
+static int
+write_results(const struct sweep_result *results, unsigned int count)
+{
+	const struct sweep_result *res;
+	unsigned int n;
+	FILE	*fp = stdout;
+
+	if (opt_output && !(fp = fopen(opt_output, "w"))) {
+		perror(opt_output);
+		return 0;
+	}
+
+	if (opt_format == FORMAT_CSV)
+		fprintf(fp, "backend,workers,files,locks,target_ops_per_sec,ops,ops_per_sec,"
+			    "acquire_p50_usec,acquire_p99_usec,acquire_p999_usec,acquire_max_usec,"
+			    "release_p99_usec,response_p50_usec,response_p99_usec,response_p999_usec,"
+			    "deadlocks,interrupts,refused,rpcs_per_op,rpc_rtt_usec,rpc_execute_usec,"
+			    "knee,collapse\n");
+	else
+		fprintf(fp, "[\n");
+
+	for (n = 0, res = results; n < count; ++n, ++res) {
+		if (opt_format == FORMAT_CSV) {
+			fprintf(fp, "%s,%d,%d,%d,%d,%lu,%.2f,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.3f,%.1f,%.1f,%d,%d\n",
+					res->backend, res->workers, res->files, res->locks,
+					res->target_rate,
+					res->count, res->rate,
+					(unsigned long) res->acquire_p50,
+					(unsigned long) res->acquire_p99,
+					(unsigned long) res->acquire_p999,
+					(unsigned long) res->acquire_max,
+					(unsigned long) res->release_p99,
+					(unsigned long) res->response_p50,
+					(unsigned long) res->response_p99,
+					(unsigned long) res->response_p999,
+					res->deadlocks, res->interrupts, res->refused,
+					res->rpcs_per_op, res->rpc_rtt, res->rpc_execute,
+					res->knee, res->collapse);
+		} else {
+			fprintf(fp, "  { \"backend\": \"%s\", "
+				    "\"workers\": %d, \"files\": %d, \"locks\": %d, "
+				    "\"target_ops_per_sec\": %d, "
+				    "\"ops\": %lu, \"ops_per_sec\": %.2f, "
+				    "\"acquire_p50_usec\": %lu, \"acquire_p99_usec\": %lu, "
+				    "\"acquire_p999_usec\": %lu, \"acquire_max_usec\": %lu, "
+				    "\"release_p99_usec\": %lu, "
+				    "\"response_p50_usec\": %lu, \"response_p99_usec\": %lu, "
+				    "\"response_p999_usec\": %lu, "
+				    "\"deadlocks\": %lu, \"interrupts\": %lu, \"refused\": %lu, "
+				    "\"rpcs_per_op\": %.3f, \"rpc_rtt_usec\": %.1f, "
+				    "\"rpc_execute_usec\": %.1f, "
+				    "\"knee\": %s, \"collapse\": %s }%s\n",
+					res->backend, res->workers, res->files, res->locks,
+					res->target_rate,
+					res->count, res->rate,
+					(unsigned long) res->acquire_p50,
+					(unsigned long) res->acquire_p99,
+					(unsigned long) res->acquire_p999,
+					(unsigned long) res->acquire_max,
+					(unsigned long) res->release_p99,
+					(unsigned long) res->response_p50,
+					(unsigned long) res->response_p99,
+					(unsigned long) res->response_p999,
+					res->deadlocks, res->interrupts, res->refused,
+					res->rpcs_per_op, res->rpc_rtt, res->rpc_execute,
+					res->knee? "true" : "false",
+					res->collapse? "true" : "false",
+					(n + 1 < count)? "," : "");
+		}
+	}
+
+	if (opt_format == FORMAT_JSON)
+		fprintf(fp, "]\n");
+
+	if (fp != stdout)
+		fclose(fp);
+	return 1;
+}
+
+static void
+wait_for_start(struct worker *w)
+{
+	w->ready = 1;
+	if (opt_pthreads) {
+		pthread_barrier_wait(&start_barrier);
+	} else {
+		/* SIGUSR1 is blocked; atomically unblock it and wait */
+		sigsuspend(&start_mask);
+		sigprocmask(SIG_SETMASK, &start_mask, NULL);
+	}
+}
+
+void
+toggle_run(int sig)
+{
+	running = !running;
+}
+
+static inline uint64_t
+now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+nsec_to_timespec(uint64_t nsec, struct timespec *ts)
+{
+	ts->tv_sec = nsec / 1000000000ULL;
+	ts->tv_nsec = nsec % 1000000000ULL;
+}
+
+/*
+ * Wait for the benchmark to complete. Every opt_interval seconds,
+ * sample the per-process counters and print the throughput of the
+ * last interval.
+ */
+void
+sample(struct worker *worker)
+{
+	unsigned long	*last, *delta;
+	uint64_t	start, end, prev, next;
+	struct timespec	ts;
+	int		n;
+
+	start = now_nsec();
+	end = start + opt_timeout * 1000000000ULL;
+
+	if (opt_interval <= 0) {
+		nsec_to_timespec(end, &ts);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		return;
+	}
+
+	last = (unsigned long *) calloc(opt_threads, sizeof(unsigned long));
+	delta = (unsigned long *) calloc(opt_threads, sizeof(unsigned long));
+	if (last == NULL || delta == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	printf("%8s %12s %10s %10s%s\n",
+			"time", "ops/sec", "min", "max",
+			opt_verbose? "  per process" : "");
+
+	for (prev = start; prev < end; prev = next) {
+		unsigned long total = 0, min = ~0UL, max = 0;
+		double	elapsed;
+
+		next = prev + opt_interval * 1000000000ULL;
+		if (next > end)
+			next = end;
+
+		nsec_to_timespec(next, &ts);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		elapsed = (next - prev) / 1e9;
+		for (n = 0; n < opt_threads; ++n) {
+			unsigned long count = worker[n].count;
+
+			delta[n] = count - last[n];
+			last[n] = count;
+
+			total += delta[n];
+			if (delta[n] < min)
+				min = delta[n];
+			if (delta[n] > max)
+				max = delta[n];
+		}
+
+		printf("%7.1fs %12.1f %10.1f %10.1f",
+				(next - start) / 1e9, total / elapsed,
+				min / elapsed, max / elapsed);
+		if (opt_verbose) {
+			printf(" ");
+			for (n = 0; n < opt_threads; ++n)
+				printf(" %.0f", delta[n] / elapsed);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	free(last);
+	free(delta);
+}
+
+static inline unsigned int
+hist_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+	if (value >= (1ULL << HIST_MAX_BITS))
+		return HIST_BUCKETS - 1;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + (value >> shift) - HIST_SUB_COUNT;
+}
+
+/*
+ * Return the highest value that maps to the given bucket
+ */
+static uint64_t
+hist_bucket_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	shift = index / HIST_SUB_COUNT - 1;
+	return ((uint64_t) (HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift)
+		+ (1ULL << shift) - 1;
+}
+
+static inline void
+hist_record(struct histogram *h, uint64_t usec)
+{
+	h->bucket[hist_bucket(usec)]++;
+	h->count++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+void
+hist_merge(struct histogram *h, const struct histogram *other)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		h->bucket[i] += other->bucket[i];
+	h->count += other->count;
+	h->sum += other->sum;
+	if (other->max > h->max)
+		h->max = other->max;
+}
+
+/*
+ * Hand the worker its share of the optional histograms: one per
+ * target if there are several, and two for herd mode. The share
+ * has room for nextra_hist of them.
+ */
+static void
+worker_hists(struct worker *w, struct histogram *h)
+{
+	if (ntargets > 1) {
+		w->target_acquire = h;
+		h += ntargets;
+	}
+	if (opt_herd) {
+		w->herd_wakeup = h++;
+		w->herd_handoff = h++;
+	}
+}
+
+uint64_t
+hist_percentile(const struct histogram *h, double pct)
+{
+	uint64_t want, seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	want = (uint64_t) (h->count * pct / 100);
+	if (want == 0)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+
+	/* Do not report more than we have actually seen */
+	if (i >= HIST_BUCKETS || hist_bucket_value(i) > h->max)
+		return h->max;
+	return hist_bucket_value(i);
+}
+
+static const char *	op_name[__OP_MAX] = {
+	[OP_RDLCK]	= "read",
+	[OP_WRLCK]	= "write",
+	[OP_UPGRADE]	= "upgrade",
+	[OP_DOWNGRADE]	= "downgrade",
+	[OP_UNLOCK]	= "unlock",
+	[OP_DEADLOCK]	= "deadlock",
+	[OP_INTR]	= "interrupted",
+	[OP_REFUSED]	= "refused",
+	[OP_OPEN]	= "open",
+	[OP_CLOSE]	= "close",
+};
+
+/*
+ * Print the latency summary. If the lock mix had more than plain
+ * write locks, break it down by operation type.
+ */
+void
+report(const struct worker *w)
+{
+	static struct histogram acquire;
+	const struct histogram *dl = &w->hist[OP_DEADLOCK];
+	char	name[64];
+	int	op;
+
+	memset(&acquire, 0, sizeof(acquire));
+	hist_merge(&acquire, &w->hist[OP_RDLCK]);
+	hist_merge(&acquire, &w->hist[OP_WRLCK]);
+	hist_report("acquire", &acquire);
+	hist_report("release", &w->hist[OP_UNLOCK]);
+	if (w->response.count)
+		hist_report("response", &w->response);
+	if (dl->count) {
+		hist_report(op_name[OP_DEADLOCK], dl);
+		printf("deadlocks: %.2f/sec, %.2f%% of lock requests\n",
+				(double) dl->count / opt_timeout,
+				100.0 * dl->count / (dl->count + acquire.count + w->hist[OP_UPGRADE].count));
+	}
+	if (w->hist[OP_INTR].count)
+		hist_report(op_name[OP_INTR], &w->hist[OP_INTR]);
+	if (w->hist[OP_REFUSED].count)
+		hist_report(op_name[OP_REFUSED], &w->hist[OP_REFUSED]);
+	if (w->hist[OP_OPEN].count) {
+		hist_report(op_name[OP_OPEN], &w->hist[OP_OPEN]);
+		hist_report(op_name[OP_CLOSE], &w->hist[OP_CLOSE]);
+		printf("fd cache: %lu lookups, %.2f%% hits\n", w->fd_lookups,
+				100.0 - 100.0 * w->hist[OP_OPEN].count / w->fd_lookups);
+	}
+
+	if (!w->hist[OP_RDLCK].count
+	 && !w->hist[OP_UPGRADE].count
+	 && !w->hist[OP_DOWNGRADE].count)
+		return;
+
+	for (op = 0; op < OP_UNLOCK; ++op) {
+		if (!w->hist[op].count)
+			continue;
+		snprintf(name, sizeof(name), "  %s", op_name[op]);
+		hist_report(name, &w->hist[op]);
+	}
+}
+
+void
+hist_report(const char *name, const struct histogram *h)
+{
+	printf("%s: %lu calls, avg %.1f, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu usec\n",
+			name,
+			(unsigned long) h->count,
+			h->count? (double) h->sum / h->count : 0.0,
+			(unsigned long) hist_percentile(h, 50),
+			(unsigned long) hist_percentile(h, 90),
+			(unsigned long) hist_percentile(h, 99),
+			(unsigned long) hist_percentile(h, 99.9),
+			(unsigned long) h->max);
+}
+
+/*
+ * Per-worker random number generator (xorshift64*)
+ */
+static void
+rng_init(struct rng *rng, uint64_t seed)
+{
+	/* Run the seed through splitmix64 so that consecutive
+	 * seeds give unrelated sequences */
+	seed += 0x9e3779b97f4a7c15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+	seed ^= seed >> 31;
+
+	rng->state = seed? seed : 1;
+}
+
+static inline uint64_t
+rng_next(struct rng *rng)
+{
+	uint64_t x = rng->state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng->state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, n) */
+static inline unsigned long
+rng_below(struct rng *rng, unsigned long n)
+{
+	return ((rng_next(rng) >> 32) * n) >> 32;
+}
+
+/* Uniform in [0, 1) */
+static inline double
+rng_double(struct rng *rng)
+{
+	return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Parse a distribution specification:
+ *   uniform
+ *   zipf:<theta>		(0 < theta < 1)
+ *   hotspot:<ops%>:<records%>
+ */
+int
+dist_parse(struct distribution *dist, const char *spec)
+{
+	char	*end;
+
+	memset(dist, 0, sizeof(*dist));
+	if (!strcmp(spec, "uniform")) {
+		dist->type = DIST_UNIFORM;
+		return 1;
+	}
+
+	if (!strncmp(spec, "zipf:", 5)) {
+		dist->type = DIST_ZIPF;
+		dist->theta = strtod(spec + 5, &end);
+		if (*end || dist->theta <= 0 || dist->theta >= 1)
+			return 0;
+		return 1;
+	}
+
+	if (!strncmp(spec, "hotspot:", 8)) {
+		dist->type = DIST_HOTSPOT;
+		dist->hot_ops = strtod(spec + 8, &end) / 100;
+		if (*end != ':')
+			return 0;
+		dist->hot_records = strtod(end + 1, &end) / 100;
+		if (*end
+		 || dist->hot_ops < 0 || dist->hot_ops > 1
+		 || dist->hot_records <= 0 || dist->hot_records > 1)
+			return 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+dist_init(struct distribution *dist, unsigned long nrecords)
+{
+	unsigned long i;
+
+	dist->nrecords = nrecords;
+	switch (dist->type) {
+	case DIST_ZIPF:
+		dist->zetan = 0;
+		for (i = 1; i <= nrecords; ++i)
+			dist->zetan += 1 / pow(i, dist->theta);
+		dist->alpha = 1 / (1 - dist->theta);
+		dist->half_pow_theta = pow(0.5, dist->theta);
+		dist->eta = (1 - pow(2.0 / nrecords, 1 - dist->theta))
+			  / (1 - (1 + dist->half_pow_theta) / dist->zetan);
+		break;
+
+	case DIST_HOTSPOT:
+		dist->nhot = dist->hot_records * nrecords;
+		if (dist->nhot == 0)
+			dist->nhot = 1;
+		break;
+	}
+}
+
+/*
+ * Draw a record number in [0, nrecords)
+ */
+static unsigned long
+dist_next(const struct distribution *dist, struct rng *rng)
+{
+	unsigned long n = dist->nrecords;
+	double	u, uz;
+
+	switch (dist->type) {
+	case DIST_ZIPF:
+		u = rng_double(rng);
+		uz = u * dist->zetan;
+		if (uz < 1)
+			return 0;
+		if (uz < 1 + dist->half_pow_theta)
+			return 1 % n;
+		n = n * pow(dist->eta * u - dist->eta + 1, dist->alpha);
+		if (n >= dist->nrecords)
+			n = dist->nrecords - 1;
+		return n;
+
+	case DIST_HOTSPOT:
+		if (dist->nhot >= n)
+			break;
+		if (rng_double(rng) < dist->hot_ops)
+			return rng_below(rng, dist->nhot);
+		return dist->nhot + rng_below(rng, n - dist->nhot);
+	}
+
+	return rng_below(rng, n);
+}
+
+/*
+ * Parse a lock mix, see the comment at the top of the file
+ */
+int
+mix_parse(struct lockmix *mix, char *spec)
+{
+	char	*word, *value, *end;
+
+	while ((word = strsep(&spec, ",")) != NULL) {
+		if (!(value = strchr(word, '=')))
+			return 0;
+		*value++ = '\0';
+
+		if (!strcmp(word, "len")) {
+			char *len;
+
+			mix->nlengths = 0;
+			while ((len = strsep(&value, "/")) != NULL) {
+				unsigned int i = mix->nlengths++;
+
+				if (i >= MAX_LENGTHS)
+					return 0;
+				mix->length[i].len = strtoul(len, &end, 0);
+				mix->length[i].weight = 1;
+				if (*end == '*')
+					mix->length[i].weight = strtod(end + 1, &end);
+				if (*end || mix->length[i].len == 0 || mix->length[i].weight <= 0)
+					return 0;
+			}
+		} else {
+			double pct = strtod(value, &end) / 100;
+
+			if (*end || pct < 0 || pct > 1)
+				return 0;
+			if (!strcmp(word, "read"))
+				mix->read = pct;
+			else if (!strcmp(word, "upgrade"))
+				mix->upgrade = pct;
+			else if (!strcmp(word, "downgrade"))
+				mix->downgrade = pct;
+			else if (!strcmp(word, "overlap"))
+				mix->overlap = pct;
+			else
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Turn the length weights into a cumulative distribution,
+ * and compute the record stride
+ */
+void
+mix_init(struct lockmix *mix)
+{
+	double	sum = 0;
+	unsigned int i;
+
+	if (mix->nlengths == 0) {
+		mix->length[0].len = LOCKLEN;
+		mix->length[0].weight = 1;
+		mix->nlengths = 1;
+	}
+
+	for (i = 0; i < mix->nlengths; ++i)
+		sum += mix->length[i].weight;
+
+	mix->stride = 0;
+	for (i = 0; i < mix->nlengths; ++i) {
+		if (mix->length[i].len > mix->stride)
+			mix->stride = mix->length[i].len;
+		mix->length[i].weight /= sum;
+		if (i)
+			mix->length[i].weight += mix->length[i - 1].weight;
+	}
+}
+
+static unsigned long
+mix_length(const struct lockmix *mix, struct rng *rng)
+{
+	double	u;
+	unsigned int i;
+
+	if (mix->nlengths == 1)
+		return mix->length[0].len;
+
+	u = rng_double(rng);
+	for (i = 0; i < mix->nlengths - 1; ++i) {
+		if (u < mix->length[i].weight)
+			break;
+	}
+	return mix->length[i].len;
+}
+
+/*
+ * Lock backends
+ */
+static int
+posix_lock(struct lock *lk, int type, int wait)
+{
+	struct flock fl = lk->fl;
+
+	fl.l_type = type;
+	return fcntl(lk->fd, wait? F_SETLKW : F_SETLK, &fl);
+}
+
+static int
+posix_unlock(struct lock *lk)
+{
+	struct flock fl = lk->fl;
+
+	fl.l_type = F_UNLCK;
+	return fcntl(lk->fd, F_SETLK, &fl);
+}
+
+static int
+ofd_lock(struct lock *lk, int type, int wait)
+{
+	struct flock fl = lk->fl;
+
+	fl.l_type = type;
+	fl.l_pid = 0;
+	return fcntl(lk->fd, wait? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+static int
+ofd_unlock(struct lock *lk)
+{
+	struct flock fl = lk->fl;
+
+	fl.l_type = F_UNLCK;
+	fl.l_pid = 0;
+	return fcntl(lk->fd, F_OFD_SETLK, &fl);
+}
+
+static int
+flock_lock(struct lock *lk, int type, int wait)
+{
+	return flock(lk->fd, (type == F_RDLCK? LOCK_SH : LOCK_EX) | (wait? 0 : LOCK_NB));
+}
+
+static int
+flock_unlock(struct lock *lk)
+{
+	return flock(lk->fd, LOCK_UN);
+}
+
+/*
+ * Leases never block; if there's a conflicting open, we get EAGAIN.
+ * Write leases require that nobody else has the file open, which is
+ * never the case here, so we only take read leases.
+ */
+static int
+lease_lock(struct lock *lk, int type, int wait)
+{
+	return fcntl(lk->fd, F_SETLEASE, F_RDLCK);
+}
+
+static int
+lease_unlock(struct lock *lk)
+{
+	return fcntl(lk->fd, F_SETLEASE, F_UNLCK);
+}
+
+static const struct backend	backends[] = {
+	{ "posix", O_RDWR,   0, 0, 1, 0, 1, posix_lock, posix_unlock },
+	{ "ofd",   O_RDWR,   0, 1, 0, 0, 1, ofd_lock,   ofd_unlock   },
+	{ "flock", O_RDWR,   1, 1, 0, 0, 0, flock_lock, flock_unlock },
+	{ "lease", O_RDONLY, 1, 1, 0, 1, 0, lease_lock, lease_unlock },
+	{ NULL }
+};
+
+const struct backend *
+backend_find(const char *name)
+{
+	const struct backend *b;
+
+	for (b = backends; b->name; ++b) {
+		if (!strcmp(b->name, name))
+			return b;
+	}
+	return NULL;
+}
+
+/*
+ * Not every file system supports leases (NFS does not), so try one
+ * on the first file of each target. EAGAIN only means somebody has
+ * the file open for writing.
+ */
+static int
+lease_probe(void)
+{
+	unsigned int t;
+	int	fd, ok;
+
+	for (t = 0; t < ntargets && t < sweep_max(&opt_sweep.files); ++t) {
+		if ((fd = open(files[t], O_RDONLY)) < 0) {
+			perror(files[t]);
+			return 0;
+		}
+		ok = fcntl(fd, F_SETLEASE, F_RDLCK) == 0 || errno == EAGAIN;
+		if (!ok)
+			fprintf(stderr, "%s: leases not supported: %s\n", files[t], strerror(errno));
+		fcntl(fd, F_SETLEASE, F_UNLCK);
+		close(fd);
+		if (!ok)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Make the given backend the current one, if it can be used with
+ * the selected options.
+ */
+int
+backend_select(const struct backend *b)
+{
+	if (opt_pthreads && !b->per_thread) {
+		fprintf(stderr, "%s locks do not conflict between threads, skipped\n", b->name);
+		return 0;
+	}
+
+	/* Without deadlock detection, sorting the locks avoids
+	 * deadlocks - but not when ranges overlap. */
+	if (!b->deadlock_detect && !b->whole_file && opt_mix.overlap) {
+		fprintf(stderr, "Overlapping locks are not supported with %s locks, skipped\n", b->name);
+		return 0;
+	}
+
+	/* Records are byte ranges; these backends lock the whole
+	 * file, so the workers would still contend. */
+	if (opt_partition == PARTITION_RECORDS && b->whole_file) {
+		fprintf(stderr, "%s locks cover whole files, -p records does not partition them, skipped\n",
+				b->name);
+		return 0;
+	}
+
+	if (opt_herd && b->shared_only) {
+		fprintf(stderr, "%s locks never conflict, skipped\n", b->name);
+		return 0;
+	}
+
+	if (opt_order == ORDER_RANDOM && !b->deadlock_detect) {
+		fprintf(stderr, "Random lock order may deadlock with %s locks, skipped\n", b->name);
+		return 0;
+	}
+
+	if (b->lock == lease_lock && !lease_probe()) {
+		fprintf(stderr, "%s locks not supported, skipped\n", b->name);
+		return 0;
+	}
+
+	if (!b->convert && (opt_mix.upgrade || opt_mix.downgrade))
+		fprintf(stderr, "%s locks cannot be converted in place, no upgrades or downgrades\n",
+				b->name);
+
+	opt_backend = b;
+	lock_order = opt_order;
+	if (lock_order == ORDER_DEFAULT)
+		lock_order = b->deadlock_detect? ORDER_ROLLING : ORDER_SORTED;
+	return 1;
+}
+
+/*
+ * Release a lock. This is done with F_SETLK (or F_OFD_SETLK) and
+ * should never block.
+ */
+static void
+lock_release(struct worker *w, struct lock *lk, struct fdcache *fc)
+{
+	uint64_t t0;
+
+	if (lk->fd == -1)
+		return;
+
+	w->target_lockops[lk->file % ntargets]++;
+	t0 = now_nsec();
+	if (opt_backend->unlock(lk) < 0) {
+		perror("unlock");
+		exit(1);
+	}
+	hist_record(&w->hist[OP_UNLOCK], (now_nsec() - t0) / 1000);
+	lk->fd = -1;
+	fdcache_put(w, fc, lk->file);
+}
+
+/*
+ * Thundering herd. Everybody fights over the first record of the
+ * first file.
+ */
+static void
+herd_lock_init(struct lock *lk)
+{
+	lk->file = 0;
+	lk->fd = open(files[0], opt_backend->open_flags);
+	if (lk->fd < 0) {
+		perror(files[0]);
+		exit(1);
+	}
+
+	lk->fl.l_type = F_WRLCK;
+	lk->fl.l_whence = SEEK_SET;
+	lk->fl.l_start = 0;
+	lk->fl.l_len = opt_backend->whole_file? 0 : LOCKLEN;
+	lk->fl.l_pid = 0;
+}
+
+/*
+ * With forked workers, check whether one of them has died. The
+ * others would then wait for it forever. Workers that are done
+ * wait for the stop signal, so any exit before that is a loss.
+ */
+static int
+herd_lost(void)
+{
+	int	status;
+
+	if (opt_pthreads || waitpid(-1, &status, WNOHANG) <= 0)
+		return 0;
+	fprintf(stderr, "*** Process exited prematurely ***\n");
+	return 1;
+}
+
+/*
+ * The holder: take the lock, wait for all workers to queue up
+ * behind it, let go, and wait for everyone to have had their turn.
+ * Returns -1 if a worker went away.
+ */
+static int
+herd_hold(void)
+{
+	struct lock lk;
+	unsigned int round;
+	int	ret = -1;
+
+	herd_lock_init(&lk);
+
+	for (round = 1; round <= opt_herd; ++round) {
+		if (opt_backend->lock(&lk, F_WRLCK, 1) < 0) {
+			perror("herd: lock");
+			exit(1);
+		}
+
+		herd->waiting = 0;
+		herd->granted = 0;
+		herd->round = round;
+		while (herd->waiting < opt_threads) {
+			if (herd_lost()) {
+				opt_backend->unlock(&lk);
+				goto out;
+			}
+			usleep(100);
+		}
+
+		/* Give the last of them time to actually block */
+		usleep(opt_herd_hold * 1000);
+
+		herd->start = herd->release = now_nsec();
+		if (opt_backend->unlock(&lk) < 0) {
+			perror("herd: unlock");
+			exit(1);
+		}
+
+		while (herd->granted < opt_threads) {
+			if (herd_lost())
+				goto out;
+			usleep(100);
+		}
+	}
+	ret = 0;
+
+out:
+	close(lk.fd);
+	return ret;
+}
+
+static void
+herd_wait(struct worker *w)
+{
+	struct lock lk;
+	unsigned int round, rank;
+	uint64_t granted;
+
+	placement_pin(w);
+	herd_lock_init(&lk);
+	wait_for_start(w);
+
+	for (round = 1; round <= opt_herd; ++round) {
+		while (herd->round != round) {
+			if (!running)
+				goto out;
+			usleep(50);
+		}
+
+		__sync_fetch_and_add(&herd->waiting, 1);
+		if (opt_backend->lock(&lk, F_WRLCK, 1) < 0) {
+			perror("herd: lock");
+			exit(1);
+		}
+		granted = now_nsec();
+
+		/* We hold the lock, so nobody else is looking */
+		rank = herd->granted;
+		if (rank == 0) {
+			hist_record(w->herd_wakeup, (granted - herd->release) / 1000);
+			w->herd_first++;
+		} else {
+			hist_record(w->herd_handoff, (granted - herd->release) / 1000);
+		}
+		if (rank + 1 == opt_threads)
+			w->herd_last++;
+		w->herd_rank_sum += rank;
+		w->herd_wait_sum += granted - herd->start;
+		w->count++;
+
+		herd->granted = rank + 1;
+		herd->release = now_nsec();
+		if (opt_backend->unlock(&lk) < 0) {
+			perror("herd: unlock");
+			exit(1);
+		}
+	}
+
+	/* Stay around until the holder is done, so that it can
+	 * tell a worker that died from one that has finished. */
+	while (running)
+		usleep(1000);
+
+out:
+	close(lk.fd);
+}
+
+/*
+ * Jain's fairness index: 1 if all values are equal, 1/n if
+ * one worker got everything.
+ */
+static double
+jain_index(const double *x, unsigned int n)
+{
+	double	sum = 0, sumsq = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; ++i) {
+		sum += x[i];
+		sumsq += x[i] * x[i];
+	}
+	return sumsq? sum * sum / (n * sumsq) : 1.0;
+}
+
+static void
+herd_report(const struct worker *worker, const struct worker *total)
+{
+	const struct worker *w;
+	double	*first, *wait;
+	int	n;
+
+	first = calloc(opt_threads, sizeof(double));
+	wait = calloc(opt_threads, sizeof(double));
+	if (first == NULL || wait == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (n = 0, w = worker; n < opt_threads; ++n, ++w) {
+		first[n] = w->herd_first;
+		wait[n] = w->count? (double) w->herd_wait_sum / w->count : 0;
+	}
+
+	printf("herd: %d waiters, %u rounds, lock held for %u msec\n",
+			opt_threads, opt_herd, opt_herd_hold);
+	hist_report("wakeup", total->herd_wakeup);
+	hist_report("handoff", total->herd_handoff);
+	printf("fairness (Jain): %.3f for first grants, %.3f for wait time\n",
+			jain_index(first, opt_threads),
+			jain_index(wait, opt_threads));
+
+	if (opt_verbose) {
+		for (n = 0, w = worker; n < opt_threads; ++n, ++w) {
+			printf("  worker %d: first %lu times, last %lu times, avg rank %.2f, avg wait %.1f usec\n",
+					n, w->herd_first, w->herd_last,
+					w->count? (double) w->herd_rank_sum / w->count : 0,
+					wait[n] / 1000);
+		}
+	}
+
+	free(first);
+	free(wait);
+}
+
+/*
+ * Multiple targets
+ */
+static int
+targets_parse(char *list)
+{
+	char	*dir;
+
+	for (dir = strtok(list, ","); dir; dir = strtok(NULL, ",")) {
+		if (ntargets >= MAX_TARGETS) {
+			fprintf(stderr, "Too many targets (max %u)\n", MAX_TARGETS);
+			return 0;
+		}
+		targets[ntargets++] = dir;
+	}
+	return ntargets != 0;
+}
+
+static void
+targets_report(const struct worker *total)
+{
+	unsigned int t;
+
+	for (t = 0; t < ntargets; ++t) {
+		printf("target %s: %lu lock operations, %9.2f ops/sec\n",
+				targets[t], total->target_count[t],
+				(double) total->target_count[t] / opt_timeout);
+		hist_report("  acquire", &total->target_acquire[t]);
+	}
+}
+
+/*
+ * Does this worker ever lock the given file?
+ */
+static int
+worker_uses_file(const struct worker *w, int file)
+{
+	unsigned int groups = opt_grouped? ntargets : 1;
+	unsigned int threads = opt_threads / groups;
+	unsigned int local = file / groups;
+
+	if (file % groups != w->index % groups)
+		return 0;
+	if (opt_partition == PARTITION_FILES)
+		return local % threads == w->index / groups
+			&& local / threads < (opt_files / groups) / threads;
+	return 1;
+}
+
+/*
+ * File descriptor cache
+ */
+static int
+fdcache_parse(const char *spec)
+{
+	char	*end;
+
+	if (!strcmp(spec, "all")) {
+		opt_fdcache = FDCACHE_ALL;
+	} else if (!strcmp(spec, "per-lock")) {
+		opt_fdcache = FDCACHE_PER_LOCK;
+	} else if (!strncmp(spec, "lru:", 4)) {
+		opt_fdcache = FDCACHE_LRU;
+		opt_fdcache_size = strtoul(spec + 4, &end, 0);
+		if (*end || opt_fdcache_size == 0)
+			return 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static int
+fdcache_open(struct fdcache *fc, int file)
+{
+	int	fd;
+
+	fd = open(files[file], opt_backend->open_flags);
+	if (fd < 0) {
+		perror(files[file]);
+		exit(1);
+	}
+	fc->fd[file] = fd;
+	fc->nopen++;
+	return fd;
+}
+
+static void
+fdcache_close(struct worker *w, struct fdcache *fc, int file)
+{
+	uint64_t t0;
+
+	t0 = now_nsec();
+	close(fc->fd[file]);
+	hist_record(&w->hist[OP_CLOSE], (now_nsec() - t0) / 1000);
+	fc->fd[file] = -1;
+	fc->nopen--;
+}
+
+static void
+fdcache_unlink(struct fdcache *fc, int file)
+{
+	if (fc->prev[file] >= 0)
+		fc->next[fc->prev[file]] = fc->next[file];
+	else
+		fc->head = fc->next[file];
+	if (fc->next[file] >= 0)
+		fc->prev[fc->next[file]] = fc->prev[file];
+	else
+		fc->tail = fc->prev[file];
+}
+
+static void
+fdcache_push(struct fdcache *fc, int file)
+{
+	fc->prev[file] = -1;
+	fc->next[file] = fc->head;
+	if (fc->head >= 0)
+		fc->prev[fc->head] = file;
+	else
+		fc->tail = file;
+	fc->head = file;
+}
+
+static void
+fdcache_init(struct worker *w, struct fdcache *fc)
+{
+	int	n;
+
+	fc->fd = calloc(opt_files, sizeof(int));
+	fc->refs = calloc(opt_files, sizeof(unsigned int));
+	fc->prev = calloc(opt_files, sizeof(int));
+	fc->next = calloc(opt_files, sizeof(int));
+	if (!fc->fd || !fc->refs || !fc->prev || !fc->next) {
+		perror("calloc");
+		exit(1);
+	}
+	fc->head = fc->tail = -1;
+	fc->nopen = 0;
+
+	for (n = 0; n < opt_files; ++n)
+		fc->fd[n] = -1;
+
+	if (opt_fdcache != FDCACHE_ALL)
+		return;
+
+	/* Open everything up front, outside of the measurement */
+	for (n = 0; n < opt_files; ++n) {
+		if (!worker_uses_file(w, n))
+			continue;
+		fdcache_open(fc, n);
+		fdcache_push(fc, n);
+	}
+}
 
-				case EDEADLK:
-					/* Count this as a successful locking operation */
-					break;
+static void
+fdcache_destroy(struct fdcache *fc)
+{
+	int	n;
 
-				default:
-					perror("setlock");
-					exit(1);
-				}
+	for (n = 0; n < opt_files; ++n) {
+		if (fc->fd[n] >= 0)
+			close(fc->fd[n]);
+	}
+	free(fc->fd);
+	free(fc->refs);
+	free(fc->prev);
+	free(fc->next);
+}
+
+/*
+ * Get an open file descriptor for a file we are about to lock. If the
+ * cache is full, close the least recently used file without locks.
+ * When all cached files are locked, the cache grows beyond its limit.
+ */
+static int
+fdcache_get(struct worker *w, struct fdcache *fc, int file)
+{
+	uint64_t t0;
+
+	w->fd_lookups++;
+	if (fc->fd[file] >= 0) {
+		if (fc->refs[file]++ == 0)
+			fdcache_unlink(fc, file);
+		return fc->fd[file];
+	}
+
+	if (opt_fdcache == FDCACHE_LRU) {
+		while (fc->nopen >= opt_fdcache_size && fc->tail >= 0) {
+			int victim = fc->tail;
+
+			fdcache_unlink(fc, victim);
+			fdcache_close(w, fc, victim);
+		}
+	}
+
+	t0 = now_nsec();
+	fdcache_open(fc, file);
+	hist_record(&w->hist[OP_OPEN], (now_nsec() - t0) / 1000);
+	fc->refs[file] = 1;
+	return fc->fd[file];
+}
+
+static void
+fdcache_put(struct worker *w, struct fdcache *fc, int file)
+{
+	if (--(fc->refs[file]))
+		return;
+	if (opt_fdcache == FDCACHE_PER_LOCK)
+		fdcache_close(w, fc, file);
+	else
+		fdcache_push(fc, file);
+}
+
+/*
+ * Pick a random record to lock next
+ */
+static void
+lock_pick(const struct worker *w, struct lock *lk, struct rng *rng)
+{
+	unsigned int groups = opt_grouped? ntargets : 1;
+	unsigned int group = w->index % groups, index = w->index / groups;
+	unsigned int threads = opt_threads / groups, gfiles = opt_files / groups;
+	unsigned long record, slot, file;
+	unsigned int nfiles;
+
+	/* Within a group, files and workers are numbered from 0 */
+	record = dist_next(&opt_dist, rng);
+	switch (opt_partition) {
+	case PARTITION_FILES:
+		/* Worker N owns files N, N + threads, ... */
+		nfiles = gfiles / threads;
+		file = index + threads * (record % nfiles);
+		slot = record / nfiles;
+		break;
+
+	case PARTITION_RECORDS:
+		/* Worker N owns records N, N + threads, ... */
+		record = record * threads + index;
+		/* fallthru */
+	default:
+		file = record % gfiles;
+		slot = record / gfiles;
+		break;
+	}
+	lk->file = file * groups + group;
+
+	lk->fl.l_type = F_WRLCK;
+	lk->fl.l_start = opt_mix.stride * slot;
+	lk->fl.l_len = mix_length(&opt_mix, rng);
+	lk->fl.l_whence = SEEK_SET;
+	lk->fl.l_pid = 0;
+
+	if (opt_mix.read && rng_double(rng) < opt_mix.read)
+		lk->fl.l_type = F_RDLCK;
+	if (opt_mix.overlap && rng_double(rng) < opt_mix.overlap)
+		lk->fl.l_len += opt_mix.stride;
+
+	if (opt_backend->whole_file) {
+		lk->fl.l_start = 0;
+		lk->fl.l_len = 0;
+	}
+	if (opt_backend->shared_only)
+		lk->fl.l_type = F_RDLCK;
+}
+
+/*
+ * Convert a lock we're holding to a different type, in place.
+ *
+ * Without deadlock detection, upgrades are attempted without blocking,
+ * because two workers upgrading the same read lock would deadlock, and
+ * the kernel would not tell us.
+ */
+static void
+lock_convert(struct worker *w, struct lock *lk, int type)
+{
+	int	op, wait;
+	uint64_t t0;
+
+	if (type == F_WRLCK) {
+		op = OP_UPGRADE;
+		wait = opt_backend->deadlock_detect;
+	} else {
+		op = OP_DOWNGRADE;
+		wait = 0;
+	}
+
+	w->target_lockops[lk->file % ntargets]++;
+	t0 = now_nsec();
+	if (opt_backend->lock(lk, type, wait) == 0) {
+		lk->fl.l_type = type;
+	} else {
+		/* We still hold the old lock */
+		switch (errno) {
+		case EINTR:
+			op = OP_INTR;
+			break;
+
+		case EDEADLK:
+			op = OP_DEADLOCK;
+			break;
+
+		case EAGAIN:
+		case EACCES:
+			op = OP_REFUSED;
+			break;
+
+		default:
+			perror("convert lock");
+			exit(1);
+		}
+	}
+
+	hist_record(&w->hist[op], (now_nsec() - t0) / 1000);
+	if (op == OP_UPGRADE || op == OP_DOWNGRADE)
+		w->count++;
+}
+
+/*
+ * In open-loop mode, sleep until the next request is due, and return
+ * the time it was scheduled for. If we are running behind, there is
+ * no sleep, and the backlog is worked off as fast as possible.
+ */
+static uint64_t
+arrival_wait(struct worker *w, struct rng *rng)
+{
+	double		gap = (double) opt_threads * 1e9 / opt_rate;
+	uint64_t	due = w->next_arrival;
+	struct timespec	ts;
+
+	if (opt_arrival == ARRIVAL_POISSON)
+		gap *= -log(1.0 - rng_double(rng));
+	w->next_arrival += (uint64_t) gap;
+
+	nsec_to_timespec(due, &ts);
+	while (running && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	return due;
+}
+
+/*
+ * Acquire a lock. In open-loop mode, due is the time the request
+ * was scheduled for.
+ */
+static void
+lock_acquire(struct worker *w, struct lock *lk, struct fdcache *fc, struct rng *rng, uint64_t due)
+{
+	uint64_t t0;
+	int	op, err;
+
+	lk->fd = fdcache_get(w, fc, lk->file);
+
+	op = (lk->fl.l_type == F_RDLCK)? OP_RDLCK : OP_WRLCK;
+
+	w->target_lockops[lk->file % ntargets]++;
+	t0 = now_nsec();
+	if (opt_backend->lock(lk, lk->fl.l_type, 1) < 0) {
+		err = errno;
+		lk->fd = -1; /* not locked */
+		fdcache_put(w, fc, lk->file);
+
+		switch (err) {
+		case EINTR:
+			hist_record(&w->hist[OP_INTR], (now_nsec() - t0) / 1000);
+			return;
+
+		case EDEADLK:
+			hist_record(&w->hist[OP_DEADLOCK], (now_nsec() - t0) / 1000);
+			return;
+
+		case EAGAIN:
+			/* Lease refused because the file is busy */
+			hist_record(&w->hist[OP_REFUSED], (now_nsec() - t0) / 1000);
+			return;
+
+		default:
+			fprintf(stderr, "setlock: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	hist_record(&w->hist[op], (now_nsec() - t0) / 1000);
+	if (ntargets > 1) {
+		hist_record(&w->target_acquire[lk->file % ntargets], (now_nsec() - t0) / 1000);
+		w->target_count[lk->file % ntargets]++;
+	}
+	if (due)
+		hist_record(&w->response, (now_nsec() - due) / 1000);
+	w->count++;
+
+	if (!opt_backend->convert)
+		return;
+	if (lk->fl.l_type == F_RDLCK) {
+		if (opt_mix.upgrade && rng_double(rng) < opt_mix.upgrade)
+			lock_convert(w, lk, F_WRLCK);
+	} else {
+		if (opt_mix.downgrade && rng_double(rng) < opt_mix.downgrade)
+			lock_convert(w, lk, F_RDLCK);
+	}
+}
+
+/*
+ * RPC statistics. Find the NFS mount a file lives on, by looking
+ * for the longest mount point that is a prefix of the file's path.
+ */
+static char *
+mountstats_mount(const char *filename)
+{
+	char	path[PATH_MAX], line[4096], mnt[4096], fstype[64];
+	char	*nfs_mount = NULL;
+	size_t	len, best = 0;
+	FILE	*fp;
+
+	if (realpath(filename, path) == NULL)
+		return NULL;
+	if (!(fp = fopen("/proc/self/mountstats", "r")))
+		return NULL;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "device %*s mounted on %4095s with fstype %63s", mnt, fstype) != 2)
+			continue;
+
+		len = strlen(mnt);
+		if (strncmp(path, mnt, len)
+		 || (path[len] != '/' && path[len] != '\0' && strcmp(mnt, "/")))
+			continue;
+		if (len < best)
+			continue;
+
+		best = len;
+		free(nfs_mount);
+		nfs_mount = NULL;
+		if (!strncmp(fstype, "nfs", 3))
+			nfs_mount = strdup(mnt);
+	}
+	fclose(fp);
+	return nfs_mount;
+}
+
+/*
+ * Find the NFS mounts of all targets. File N lives in target N.
+ */
+static void
+mountstats_find(void)
+{
+	struct rpc_mount *rm;
+	unsigned int t, m;
+	char	*mnt;
+
+	for (t = 0; t < ntargets && t < sweep_max(&opt_sweep.files); ++t) {
+		if (!(mnt = mountstats_mount(files[t])))
+			continue;
+
+		for (m = 0; m < nrpc_mounts; ++m) {
+			if (!strcmp(rpc_mounts[m].path, mnt))
+				break;
+		}
+		rm = &rpc_mounts[m];
+		if (m == nrpc_mounts) {
+			rm->path = mnt;
+			nrpc_mounts++;
+		} else {
+			free(mnt);
+		}
+		rm->targets |= 1 << t;
+	}
+
+	for (m = 0, rm = rpc_mounts; m < nrpc_mounts; ++m, ++rm) {
+		printf("rpc statistics from %s", rm->path);
+		if (ntargets > 1) {
+			printf(" for");
+			for (t = 0; t < ntargets; ++t) {
+				if (rm->targets & (1 << t))
+					printf(" %s", targets[t]);
+			}
+		}
+		printf("\n");
+	}
+}
+
+static int
+mountstats_read(const char *nfs_mount, struct mountstats *ms)
+{
+	char	line[4096], mnt[4096];
+	int	found = 0, per_op = 0;
+	struct rpc_op *op;
+	FILE	*fp;
+
+	ms->nops = 0;
+	if (!(fp = fopen("/proc/self/mountstats", "r"))) {
+		perror("/proc/self/mountstats");
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (!strncmp(line, "device ", 7)) {
+			if (found)
+				break;
+			found = sscanf(line, "device %*s mounted on %4095s", mnt) == 1
+				&& !strcmp(mnt, nfs_mount);
+			continue;
+		}
+		if (!found)
+			continue;
+		if (strstr(line, "per-op statistics")) {
+			per_op = 1;
+			continue;
+		}
+		if (!per_op || ms->nops >= MAX_RPC_OPS)
+			continue;
+
+		op = &ms->op[ms->nops];
+		if (sscanf(line, " %23[^:]: %lu %lu %lu %*u %*u %lu %lu %lu",
+					op->name,
+					&op->ops, &op->trans, &op->timeouts,
+					&op->queue, &op->rtt, &op->execute) == 7)
+			ms->nops++;
+	}
+	fclose(fp);
+
+	if (!found) {
+		fprintf(stderr, "%s: mount disappeared from mountstats\n", nfs_mount);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Snapshots around the timed part of a run
+ */
+static void
+mountstats_start(void)
+{
+	unsigned int m;
+
+	rpc_valid = nrpc_mounts != 0;
+	for (m = 0; m < nrpc_mounts && rpc_valid; ++m)
+		rpc_valid = mountstats_read(rpc_mounts[m].path, &rpc_mounts[m].before);
+}
+
+static void
+mountstats_stop(void)
+{
+	unsigned int m;
+
+	for (m = 0; m < nrpc_mounts && rpc_valid; ++m)
+		rpc_valid = mountstats_read(rpc_mounts[m].path, &rpc_mounts[m].after);
+}
+
+static int
+rpc_is_lock(const char *name)
+{
+	return !strcmp(name, "LOCK") || !strcmp(name, "LOCKU") || !strcmp(name, "LOCKT");
+}
+
+/*
+ * Subtract the "before" snapshot of a mount from the "after" one,
+ * and print the RPC traffic per lock operation on its targets.
+ */
+static void
+mountstats_report_mount(const char *name, struct rpc_mount *rm, unsigned long lockops,
+		unsigned long *callsp, unsigned long *rttp, unsigned long *executep)
+{
+	const struct mountstats *before = &rm->before;
+	unsigned long calls = 0, rtt = 0, execute = 0;
+	struct rpc_op *op;
+	unsigned int i, j;
+
+	for (i = 0, op = rm->after.op; i < rm->after.nops; ++i, ++op) {
+		for (j = 0; j < before->nops; ++j) {
+			if (!strcmp(before->op[j].name, op->name))
+				break;
+		}
+		if (j < before->nops) {
+			op->ops -= before->op[j].ops;
+			op->trans -= before->op[j].trans;
+			op->timeouts -= before->op[j].timeouts;
+			op->queue -= before->op[j].queue;
+			op->rtt -= before->op[j].rtt;
+			op->execute -= before->op[j].execute;
+		}
+
+		calls += op->ops;
+		rtt += op->rtt;
+		execute += op->execute;
+	}
+
+	printf("%s: %lu calls, %.3f per lock operation, avg rtt %.1f, avg execute %.1f usec\n",
+			name, calls,
+			lockops? (double) calls / lockops : 0,
+			calls? 1000.0 * rtt / calls : 0,
+			calls? 1000.0 * execute / calls : 0);
+
+	for (i = 0, op = rm->after.op; i < rm->after.nops; ++i, ++op) {
+		if (!op->ops || (!opt_verbose && !rpc_is_lock(op->name)))
+			continue;
+		printf("  %s: %lu calls, %.3f per lock operation, %lu retrans, %lu timeouts, "
+		       "avg rtt %.1f, avg execute %.1f usec\n",
+				op->name, op->ops,
+				lockops? (double) op->ops / lockops : 0,
+				op->trans - op->ops, op->timeouts,
+				1000.0 * op->rtt / op->ops,
+				1000.0 * op->execute / op->ops);
+	}
+
+	*callsp += calls;
+	*rttp += rtt;
+	*executep += execute;
+}
+
+/*
+ * Report the RPC traffic of every mount, against the lock operations
+ * on the targets that live on it. Every timed call to the lock backend
+ * counts as one lock operation. The total, which goes into the results,
+ * covers only the targets on NFS.
+ */
+static void
+mountstats_report(const struct worker *total, struct sweep_result *res)
+{
+	unsigned long lockops, all_lockops = 0, calls = 0, rtt = 0, execute = 0;
+	unsigned long nfs_lockops = 0;
+	unsigned int m, t;
+	char	name[PATH_MAX + 8];
+
+	for (m = 0; m < nrpc_mounts; ++m) {
+		struct rpc_mount *rm = &rpc_mounts[m];
+
+		lockops = 0;
+		for (t = 0; t < ntargets; ++t) {
+			if (rm->targets & (1 << t))
+				lockops += total->target_lockops[t];
+		}
+		nfs_lockops += lockops;
+
+		if (nrpc_mounts > 1)
+			snprintf(name, sizeof(name), "rpc %s", rm->path);
+		else
+			snprintf(name, sizeof(name), "rpc");
+		mountstats_report_mount(name, rm, lockops, &calls, &rtt, &execute);
+	}
+
+	res->rpcs_per_op = nfs_lockops? (double) calls / nfs_lockops : 0;
+	res->rpc_rtt = calls? 1000.0 * rtt / calls : 0;
+	res->rpc_execute = calls? 1000.0 * execute / calls : 0;
+
+	if (nrpc_mounts > 1)
+		printf("rpc total: %lu calls, %.3f per lock operation, avg rtt %.1f, avg execute %.1f usec\n",
+				calls, res->rpcs_per_op,
+				res->rpc_rtt, res->rpc_execute);
+
+	for (t = 0; t < ntargets; ++t)
+		all_lockops += total->target_lockops[t];
+	if (nfs_lockops != all_lockops)
+		printf("rpc: only %lu of %lu lock operations were on NFS targets\n",
+				nfs_lockops, all_lockops);
+}
+
+/*
+ * CPU placement
+ */
+static int
+placement_parse(const char *name)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(place_name) / sizeof(place_name[0]); ++n) {
+		if (!strcmp(name, place_name[n]))
+			return n;
+	}
+	return -1;
+}
+
+/*
+ * Find out which NUMA node each CPU belongs to. Node cpulists
+ * look like "0-7,16-23". Node numbers need not be contiguous, so
+ * we look at every nodeN directory there is. Without sysfs,
+ * everything is node 0.
+ */
+static void
+placement_nodes(int *node_of)
+{
+	char	path[300], buf[4096], *s;
+	int	node, from, to;
+	struct dirent *de;
+	DIR	*dir;
+	FILE	*fp;
+
+	if ((dir = opendir("/sys/devices/system/node")) == NULL) {
+		nnodes = 1;
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, "node", 4) || !isdigit(de->d_name[4]))
+			continue;
+		node = strtoul(de->d_name + 4, &s, 10);
+		if (*s)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", de->d_name);
+		if (!(fp = fopen(path, "r")))
+			continue;
+		if (fgets(buf, sizeof(buf), fp) == NULL)
+			buf[0] = '\0';
+		fclose(fp);
+
+		for (s = buf; isdigit(*s); ) {
+			from = to = strtoul(s, &s, 10);
+			if (*s == '-')
+				to = strtoul(s + 1, &s, 10);
+			while (from <= to && from < CPU_SETSIZE)
+				node_of[from++] = node;
+			if (*s == ',')
+				++s;
+		}
+		if (node > max_node)
+			max_node = node;
+		nnodes++;
+	}
+	closedir(dir);
+
+	if (nnodes == 0)
+		nnodes = 1;
+}
+
+static int
+cpu_compare_node(const void *a, const void *b)
+{
+	const struct cpu *ca = a, *cb = b;
+
+	if (ca->node != cb->node)
+		return ca->node - cb->node;
+	return ca->cpu - cb->cpu;
+}
+
+/*
+ * Build the list of CPUs we are allowed to run on, in the order
+ * workers get assigned to them.
+ */
+static int
+placement_init(void)
+{
+	static int node_of[CPU_SETSIZE];
+	struct cpu *sorted;
+	cpu_set_t set;
+	int	cpu, node, n, k;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_getaffinity");
+		return 0;
+	}
+
+	placement_nodes(node_of);
+
+	cpus = calloc(CPU_COUNT(&set), sizeof(cpus[0]));
+	sorted = calloc(CPU_COUNT(&set), sizeof(sorted[0]));
+	if (cpus == NULL || sorted == NULL) {
+		perror("calloc");
+		return 0;
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		cpus[ncpus].cpu = cpu;
+		cpus[ncpus].node = node_of[cpu];
+		ncpus++;
+	}
+
+	if (opt_placement == PLACE_RR) {
+		free(sorted);
+		return 1;
+	}
+
+	memcpy(sorted, cpus, ncpus * sizeof(sorted[0]));
+	qsort(sorted, ncpus, sizeof(sorted[0]), cpu_compare_node);
+
+	if (opt_placement == PLACE_COMPACT) {
+		free(cpus);
+		cpus = sorted;
+		return 1;
+	}
+
+	/* Spread: take the first unused CPU of each node in turn */
+	for (n = 0; n < ncpus; ) {
+		for (node = 0; node <= max_node; ++node) {
+			for (k = 0; k < ncpus; ++k) {
+				if (sorted[k].node == node && sorted[k].cpu >= 0)
+					break;
+			}
+			if (k < ncpus) {
+				cpus[n++] = sorted[k];
+				sorted[k].cpu = -1;
 			}
+		}
+	}
+	free(sorted);
+	return 1;
+}
+
+static int
+placement_cpu(unsigned int index)
+{
+	if (opt_placement == PLACE_NONE || ncpus == 0)
+		return -1;
+	return cpus[index % ncpus].cpu;
+}
+
+/*
+ * Move the calling process or thread to the worker's CPU
+ */
+static void
+placement_pin(const struct worker *w)
+{
+	cpu_set_t set;
+
+	if (w->cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		exit(1);
+	}
+}
+
+static int
+lock_compare(const void *a, const void *b)
+{
+	const struct lock *la = a, *lb = b;
+
+	if (la->file != lb->file)
+		return la->file - lb->file;
+	if (la->fl.l_start < lb->fl.l_start)
+		return -1;
+	return la->fl.l_start > lb->fl.l_start;
+}
+
+void
+run(struct worker *w)
+{
+	struct lock	lock[NUMCONCURRENT];
+	struct fdcache	fdcache;
+	struct rng	rng;
+	uint64_t	due;
+	int		n;
+
+	fdcache_init(w, &fdcache);
 
-			count++;
+	for (n = 0; n < NUMCONCURRENT; ++n)
+		lock[n].fd = -1;
+
+	placement_pin(w);
+
+	rng_init(&rng, opt_seed * 1000003 + w->index);
+
+	wait_for_start(w);
+
+	/* Stagger the workers' schedules, so that the aggregate
+	 * arrivals are evenly spaced */
+	if (opt_rate)
+		w->next_arrival = now_nsec() + (uint64_t) (w->index * 1e9 / opt_rate);
+
+	while (running) {
+		if (opt_rate) {
+			/* One lock per arrival. Don't hold on to it while
+			 * we wait for the next one. */
+			lock_release(w, &lock[0], &fdcache);
+			due = arrival_wait(w, &rng);
+			if (!running)
+				break;
+			lock_pick(w, &lock[0], &rng);
+			lock_acquire(w, &lock[0], &fdcache, &rng, due);
+		} else if (lock_order != ORDER_ROLLING) {
+			/* Drop all locks, and acquire a new batch, in
+			 * ascending order unless asked otherwise. */
+			for (n = 0; n < NUMCONCURRENT; ++n) {
+				lock_release(w, &lock[n], &fdcache);
+				lock_pick(w, &lock[n], &rng);
+			}
+			if (lock_order == ORDER_SORTED)
+				qsort(lock, NUMCONCURRENT, sizeof(lock[0]), lock_compare);
+			for (n = 0; n < NUMCONCURRENT; ++n) {
+				/* Asking for a record we already hold would be
+				 * an upgrade in disguise, which may deadlock */
+				if (lock_order == ORDER_SORTED && n
+				 && lock_compare(&lock[n - 1], &lock[n]) == 0)
+					continue;
+				lock_acquire(w, &lock[n], &fdcache, &rng, 0);
+			}
+		} else {
+			for (n = 0; n < NUMCONCURRENT; ++n) {
+				lock_release(w, &lock[n], &fdcache);
+				lock_pick(w, &lock[n], &rng);
+				lock_acquire(w, &lock[n], &fdcache, &rng, 0);
+			}
 		}
 	}
 
-	printf("%lu\n", count);
-	exit(0);
+	/* Threads share the process, so we need to drop our locks
+	 * before we go away. */
+	for (n = 0; n < NUMCONCURRENT; ++n)
+		lock_release(w, &lock[n], &fdcache);
+	fdcache_destroy(&fdcache);
+}
+
+static void *
+run_thread(void *arg)
+{
+	if (opt_herd)
+		herd_wait((struct worker *) arg);
+	else
+		run((struct worker *) arg);
+	return NULL;
 }
 
 void
@@ -293,6 +3276,14 @@ usage(int exval)
 {
 	fprintf(stderr,
 		"usage: lockbench [-b basename] [-f numfiles] [-l numlocks]\n"
-		"                 [-n numthreads] [-t timeout]\n");
+		"                 [-n numthreads] [-t timeout] [-i interval] [-Tv]\n"
+		"                 [-d uniform|zipf:theta|hotspot:ops%%:records%%] [-s seed]\n"
+		"                 [-m read=%%,upgrade=%%,downgrade=%%,overlap=%%,len=n*weight/...]\n"
+		"                 [-p none|files|records] [-B posix,ofd,flock,lease]\n"
+		"                 [-S [workers=]from:to:[*]step[,files=...][,locks=...][,rate=...]]\n"
+		"                 [-o csv|json[:filename]] [-r rate] [-a constant|poisson]\n"
+		"                 [-c none|rr|compact|spread] [-O sorted|random]\n"
+		"                 [-C all|lru:N|per-lock] [-D dir,dir,... [-G]]\n"
+		"                 [-H rounds[:msec]]\n");
 	exit(exval);
 }
@@ -32,7 +32,9 @@
 #include <stdlib.h>
 #include <sys/file.h>
 #include <sys/vfs.h>
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/statvfs.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
@@ -43,6 +45,7 @@
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 
 struct file_data {
 	char *		name;
@@ -67,6 +70,7 @@ static int	nfsmmap(int argc, char **argv);
 static int	nfslock_coherence(int argc, char **argv);
 static int	nfschmod(int argc, char **argv);
 static int	parse_size(const char *, size_t *);
+static int	parse_bufsize(const char *);
 static int	parse_device(const char *, dev_t *);
 
 static void	change_user(const char *username, const char *groupname);
@@ -74,15 +78,25 @@ static int	create_file(struct file_data *data, const char *name, int flags, off6
 static int	open_existing_file(struct file_data *data, const char *name, int flags);
 static int	generate_file(struct file_data *data, const char *name, size_t filesize);
 static int	__generate_file(struct file_data *data, int fd, int use_mmap);
+static int	generate_file_striped(struct file_data *data, int fd, unsigned int nthreads, size_t stripe);
 static int	verify_file(const char *ident, int fd, const struct file_data *data);
+static int	verify_file_parallel(const char *ident, int fd, const struct file_data *data, unsigned int nthreads);
 static int	verify_file_stat(const char *pathname, int format, dev_t dev, mode_t permissions);
 static int	make_socket(const char *, mode_t mode);
 static int	make_fifo(const char *, mode_t);
 static int	make_device(const char *, mode_t, dev_t);
+static void *	alloc_buffer(size_t size);
+static int	keep_direct(int fd, int want, int direct, off64_t pos, size_t chunk);
+static size_t	next_chunk(off64_t pos, off64_t end, int direct);
+static int	reopen_file(const struct file_data *data, int fd);
+static double	elapsed_since(const struct timeval *t0);
+static void	report_throughput(const char *what, size_t bytes, double elapsed);
 
 static int	opt_quiet = 0;
+static size_t	opt_bufsize = 4096;
 
 #define SILLY_MAX	(1024 * 1024)
+#define BUFSIZE_MAX	(64 * 1024 * 1024)
 
 static inline unsigned int
 pad32(unsigned int count)
@@ -139,8 +153,8 @@ usage:
 			"       Execute the test as the given user (can be either a user name or a uid)\n"
 			"       When a user name is given, this will also set the process gid and auxiliary gids\n"
 			"\nValid commands:\n"
-			"  nfs create-file file ...\n"
-			"  nfs verify-file file ...\n"
+			"  nfs create-file [-b bufsize] [-d] [-j threads [-s stripe]] file ...\n"
+			"  nfs verify-file [-b bufsize] [-d] [-j threads] file ...\n"
 			"  nfs create-special path ...\n"
 			"  nfs lock [-bntx] file ...\n"
 			"  nfs silly-rename file1 file2\n"
@@ -272,15 +286,31 @@ nfscreate(int argc, char **argv)
 	size_t	opt_filesize = 0;
 	size_t	opt_count = 4096;
 	size_t	opt_offset = 0;
+	size_t	opt_stripe = 1024 * 1024;
+	unsigned int opt_threads = 0;
 	int	opt_mmap = 0;
-	int	c, fd;
+	int	c, fd, res;
 
-	while ((c = getopt(argc, argv, "c:mn:o:x")) != -1) {
+	while ((c = getopt(argc, argv, "b:c:dj:mn:o:s:x")) != -1) {
 		switch (c) {
+		case 'b':
+			if (!parse_bufsize(optarg))
+				return 1;
+			break;
+		case 'd':
+			opt_flags |= O_DIRECT;
+			break;
 		case 'c':
 			if (!parse_size(optarg, &opt_count))
 				return 1;
 			break;
+		case 'j':
+			opt_threads = strtoul(optarg, NULL, 0);
+			if (opt_threads == 0) {
+				fprintf(stderr, "Invalid number of threads \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
 		case 'm':
 			opt_mmap = 1;
 			opt_flags = (opt_flags & ~O_ACCMODE) | O_RDWR;
@@ -292,6 +322,15 @@ nfscreate(int argc, char **argv)
 			if (!parse_size(optarg, &opt_offset))
 				return 1;
 			break;
+		case 's':
+			if (!parse_size(optarg, &opt_stripe))
+				return 1;
+			/* Stripes must start on a record boundary */
+			if (opt_stripe == 0 || (opt_stripe % 32)) {
+				fprintf(stderr, "stripe size must be a non-zero multiple of 32\n");
+				return 1;
+			}
+			break;
 		case 'x':
 			opt_flags |= O_EXCL;
 			break;
@@ -314,12 +353,23 @@ nfscreate(int argc, char **argv)
 		return 1;
 	}
 
+	if (opt_threads && opt_mmap) {
+		fprintf(stderr, "-j and -m cannot be combined\n");
+		return 1;
+	}
+
+	if (opt_threads && (opt_flags & O_DIRECT) && (opt_stripe % getpagesize())) {
+		fprintf(stderr, "with -d, the stripe size must be a multiple of %d\n", getpagesize());
+		return 1;
+	}
+
 	if (!(opt_flags & O_EXCL))
 		opt_flags |= O_TRUNC;
 
 	while (optind < argc) {
 		const char *filename = argv[optind++];
 		struct file_data fdata;
+		struct timeval t0;
 
 		printf("Creating file %s\n", filename);
 		fd = create_file(&fdata, filename, opt_flags, opt_offset, opt_filesize);
@@ -330,13 +380,19 @@ nfscreate(int argc, char **argv)
 
 		printf("Writing pattern of %ld bytes at offset %ld to file %s\n",
 				(long) opt_count, (long) opt_offset, filename);
-		if (__generate_file(&fdata, fd, opt_mmap) < 0) {
+		gettimeofday(&t0, NULL);
+		if (opt_threads)
+			res = generate_file_striped(&fdata, fd, opt_threads, opt_stripe);
+		else
+			res = __generate_file(&fdata, fd, opt_mmap);
+		if (res < 0) {
 			printf("Unable to write to file, exiting\n");
 			return 1;
 		}
 
 		printf("Closing file.\n");
 		close(fd);
+		report_throughput("Wrote", opt_count, elapsed_since(&t0));
 		printf("Done.\n");
 	}
 	return 0;
@@ -346,10 +402,26 @@ int
 nfsverify(int argc, char **argv)
 {
 	size_t	opt_offset = 0;
-	int	c, fd;
+	unsigned int opt_threads = 0;
+	int	opt_flags = O_RDONLY;
+	int	c, fd, okay;
 
-	while ((c = getopt(argc, argv, "o:")) != -1) {
+	while ((c = getopt(argc, argv, "b:dj:o:")) != -1) {
 		switch (c) {
+		case 'b':
+			if (!parse_bufsize(optarg))
+				return 1;
+			break;
+		case 'd':
+			opt_flags |= O_DIRECT;
+			break;
+		case 'j':
+			opt_threads = strtoul(optarg, NULL, 0);
+			if (opt_threads == 0) {
+				fprintf(stderr, "Invalid number of threads \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
 		case 'o':
 			if (!parse_size(optarg, &opt_offset))
 				return 1;
@@ -368,15 +440,23 @@ nfsverify(int argc, char **argv)
 	while (optind < argc) {
 		const char *filename = argv[optind++];
 		struct file_data fdata;
+		struct timeval t0;
 
-		fd = open_existing_file(&fdata, filename, O_RDONLY);
+		fd = open_existing_file(&fdata, filename, opt_flags);
 		if (fd < 0)
 			return 1;
 
 		fdata.offset = opt_offset;
-		if (verify_file(filename, fd, &fdata) < 0)
+		gettimeofday(&t0, NULL);
+		if (opt_threads)
+			okay = verify_file_parallel(filename, fd, &fdata, opt_threads);
+		else
+			okay = verify_file(filename, fd, &fdata);
+		if (!okay)
 			return 1;
 		close(fd);
+		if (fdata.size > opt_offset)
+			report_throughput("Verified", fdata.size - opt_offset, elapsed_since(&t0));
 	}
 	return 0;
 }
@@ -1963,6 +2043,20 @@ failed:
 	return 0;
 }
 
+static int
+parse_bufsize(const char *input)
+{
+	if (!parse_size(input, &opt_bufsize))
+		return 0;
+	/* The pattern restarts at every buffer, so we must not
+	 * cut records in half */
+	if (opt_bufsize == 0 || opt_bufsize > BUFSIZE_MAX || (opt_bufsize % 32)) {
+		fprintf(stderr, "buffer size must be a multiple of 32 between 32 and %u bytes\n", BUFSIZE_MAX);
+		return 0;
+	}
+	return 1;
+}
+
 int
 parse_device(const char *input, dev_t *dev)
 {
@@ -1987,22 +2081,158 @@ parse_device(const char *input, dev_t *dev)
 	return 1;
 }
 
+/*
+ * The file pattern consists of 32 byte records of the form
+ *   "dddddddd:iiiiiiii:oooooooooooo \n"
+ * with device, inode number and file offset of the record in hex.
+ *
+ * We format the record once and then only update the offset digits:
+ * the upper 8 of them change every 64K, the lower 4 every record.
+ * Devices and inodes that do not fit into 8 digits, and offsets that
+ * do not fit into 12, push the rest of the record out; we handle these
+ * the slow way, keeping the first 32 bytes of every record.
+ */
+static const char	hexdigit[16] = "0123456789abcdef";
+
+static inline void
+put_hex(char *p, unsigned long value, unsigned int ndigits)
+{
+	while (ndigits--) {
+		p[ndigits] = hexdigit[value & 0xf];
+		value >>= 4;
+	}
+}
+
 static unsigned int
 generate_buffer(const struct file_data *data, unsigned long offset, unsigned char *buffer, unsigned int count)
 {
+	char record[64];
+	unsigned long pos, high = ~0UL;
 	unsigned int k;
 
 	assert((count % 32) == 0);
+	if ((unsigned long) data->dev > 0xffffffffUL
+	 || (unsigned long) data->ino > 0xffffffffUL
+	 || offset + count > (1UL << 48)) {
+		for (k = 0; k < count; k += 32) {
+			snprintf(record, sizeof(record), "%08lx:%08lx:%012lx \n",
+					(unsigned long) data->dev,
+					(unsigned long) data->ino,
+					(unsigned long) offset + k);
+			memcpy(buffer + k, record, 32);
+		}
+		return count;
+	}
+
+	snprintf(record, sizeof(record), "%08lx:%08lx:%012lx \n",
+			(unsigned long) data->dev,
+			(unsigned long) data->ino,
+			offset);
 	for (k = 0; k < count; k += 32) {
-		sprintf((char *) buffer + k, "%08lx:%08lx:%012lx \n",
-				(unsigned long) data->dev,
-				(unsigned long) data->ino,
-				(unsigned long) offset + k);
+		pos = offset + k;
+		if ((pos >> 16) != high) {
+			high = pos >> 16;
+			put_hex(record + 18, high, 8);
+		}
+		put_hex(record + 26, pos, 4);
+		memcpy(buffer + k, record, 32);
 	}
 
 	return count;
 }
 
+/*
+ * I/O buffers are page aligned, so that they can be used with O_DIRECT.
+ * They are padded to a multiple of 32 for generate_buffer.
+ */
+static void *
+alloc_buffer(size_t size)
+{
+	void *buffer;
+
+	if (posix_memalign(&buffer, getpagesize(), pad32(size))) {
+		fprintf(stderr, "unable to allocate %lu byte buffer\n", (long) size);
+		return NULL;
+	}
+	return buffer;
+}
+
+/*
+ * O_DIRECT transfers must be aligned in position and size. Turn O_DIRECT
+ * off for a transfer that isn't (at the start or the end of a range), and
+ * back on for the next one that is. This changes the open file, so the
+ * file descriptor must not be shared between threads.
+ */
+static int
+keep_direct(int fd, int want, int direct, off64_t pos, size_t chunk)
+{
+	int aligned = !((pos | chunk) & (getpagesize() - 1));
+	int flags;
+
+	if (want && aligned != direct) {
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, aligned? (flags | O_DIRECT) : (flags & ~O_DIRECT));
+		direct = aligned;
+	}
+	return direct;
+}
+
+/*
+ * Size of the transfer at pos. With O_DIRECT, transfers end on a page
+ * boundary where possible, so that after an unaligned start the rest
+ * of the range is aligned again.
+ */
+static size_t
+next_chunk(off64_t pos, off64_t end, int direct)
+{
+	size_t chunk;
+	off64_t stop;
+
+	if ((chunk = end - pos) > opt_bufsize)
+		chunk = opt_bufsize;
+	if (direct && pos + chunk < end) {
+		stop = (pos + chunk) & ~(off64_t) (getpagesize() - 1);
+		if (stop > pos)
+			chunk = stop - pos;
+	}
+	return chunk;
+}
+
+/*
+ * Threads get a file descriptor of their own, see keep_direct()
+ */
+static int
+reopen_file(const struct file_data *data, int fd)
+{
+	int nfd;
+
+	if ((nfd = open(data->name, fcntl(fd, F_GETFL))) < 0)
+		fprintf(stderr, "unable to open file %s: %m\n", data->name);
+	return nfd;
+}
+
+static double
+elapsed_since(const struct timeval *t0)
+{
+	struct timeval t1, delta;
+
+	gettimeofday(&t1, NULL);
+	timersub(&t1, t0, &delta);
+	return delta.tv_sec + delta.tv_usec * 1e-6;
+}
+
+static void
+report_throughput(const char *what, size_t bytes, double elapsed)
+{
+	if (opt_quiet)
+		return;
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+	printf("%s %lu bytes in %.3f seconds (%.1f MiB/s)\n",
+			what, (unsigned long) bytes, elapsed,
+			bytes / elapsed / (1024 * 1024));
+}
+
 static void
 init_file(struct file_data *data, const char *name, off64_t offset, size_t filesize)
 {
@@ -2037,6 +2267,7 @@ open_existing_file(struct file_data *data, const char *name, int flags)
 		return -1;
 	}
 
+	init_file(data, name, 0, 0);
 	if (fstat(fd, &stb) < 0) {
 		fprintf(stderr, "unable to stat \"%s\": %m", data->name);
 		return -1;
@@ -2047,13 +2278,13 @@ open_existing_file(struct file_data *data, const char *name, int flags)
 	return fd;
 }
 
+/*
+ * The pattern includes device and inode number of the file
+ */
 static int
-__generate_file(struct file_data *data, int fd, int use_mmap)
+get_file_id(struct file_data *data, int fd)
 {
 	struct stat stb;
-	unsigned char buffer[4096];
-	unsigned char *mapped = NULL;
-	size_t written;
 
 	if (fstat(fd, &stb) < 0) {
 		fprintf(stderr, "unable to stat \"%s\": %m", data->name);
@@ -2061,6 +2292,19 @@ __generate_file(struct file_data *data, int fd, int use_mmap)
 	}
 	data->dev = stb.st_dev;
 	data->ino = stb.st_ino;
+	return 0;
+}
+
+static int
+__generate_file(struct file_data *data, int fd, int use_mmap)
+{
+	unsigned char *buffer;
+	unsigned char *mapped = NULL;
+	size_t written;
+	int want, direct;
+
+	if (get_file_id(data, fd) < 0)
+		return -1;
 
 #if 0
 	if (data->size > SILLY_MAX)
@@ -2089,12 +2333,15 @@ __generate_file(struct file_data *data, int fd, int use_mmap)
 		}
 	}
 
+	if ((buffer = alloc_buffer(opt_bufsize)) == NULL)
+		return -1;
+	want = direct = !!(fcntl(fd, F_GETFL) & O_DIRECT);
+
 	for (written = data->offset; written < data->size; ) {
 		size_t chunk;
 		ssize_t n;
 
-		if ((chunk = data->size - written) > sizeof(buffer))
-			chunk = sizeof(buffer);
+		chunk = next_chunk(written, data->size, want && !mapped);
 
 		n = generate_buffer(data, written, buffer, pad32(chunk));
 		assert(n >= chunk);
@@ -2103,21 +2350,152 @@ __generate_file(struct file_data *data, int fd, int use_mmap)
 			memcpy(mapped, buffer, chunk);
 			mapped += chunk;
 		} else {
+			direct = keep_direct(fd, want, direct, written, chunk);
 			n = write(fd, buffer, chunk);
 			if (n < 0) {
 				fprintf(stderr, "%s: write error: %m\n", data->name);
-				return -1;
+				goto failed;
 			}
 			if (n != chunk) {
 				fprintf(stderr, "%s: short write (wrote %lu rather than %lu)\n", data->name,
 						(long) n, (long) chunk);
-				return -1;
+				goto failed;
 			}
 		}
 		written += n;
 	}
 
+	free(buffer);
 	return fd;
+
+failed:
+	free(buffer);
+	return -1;
+}
+
+/*
+ * Write the file from several threads at once. Since the pattern
+ * encodes the offset, every stripe can be generated on its own.
+ * Thread i writes stripes i, i + nthreads, i + 2 * nthreads, ...
+ */
+struct stripe_writer {
+	pthread_t		thread;
+	const struct file_data *data;
+	int			fd;
+	unsigned int		index, nthreads;
+	size_t			stripe;
+	size_t			written;
+	double			elapsed;
+	int			error;
+};
+
+static void *
+stripe_writer(void *arg)
+{
+	struct stripe_writer *w = arg;
+	const struct file_data *data = w->data;
+	unsigned char *buffer;
+	off64_t start, end, pos;
+	struct timeval t0;
+	int want, direct;
+
+	if ((buffer = alloc_buffer(opt_bufsize)) == NULL) {
+		w->error = 1;
+		return NULL;
+	}
+	want = direct = !!(fcntl(w->fd, F_GETFL) & O_DIRECT);
+
+	gettimeofday(&t0, NULL);
+	for (start = data->offset + (off64_t) w->index * w->stripe; start < data->size;
+	     start += (off64_t) w->nthreads * w->stripe) {
+		if ((end = start + w->stripe) > data->size)
+			end = data->size;
+
+		for (pos = start; pos < end; ) {
+			size_t chunk;
+			ssize_t n;
+
+			chunk = next_chunk(pos, end, want);
+			n = generate_buffer(data, pos, buffer, pad32(chunk));
+			assert(n >= chunk);
+
+			direct = keep_direct(w->fd, want, direct, pos, chunk);
+			n = pwrite64(w->fd, buffer, chunk, pos);
+			if (n < 0) {
+				fprintf(stderr, "%s: write error at %lld: %m\n", data->name,
+						(long long) pos);
+				goto failed;
+			}
+			if (n != chunk) {
+				fprintf(stderr, "%s: short write at %lld (wrote %lu rather than %lu)\n",
+						data->name, (long long) pos, (long) n, (long) chunk);
+				goto failed;
+			}
+			pos += n;
+			w->written += n;
+		}
+	}
+	w->elapsed = elapsed_since(&t0);
+	free(buffer);
+	return NULL;
+
+failed:
+	w->error = 1;
+	free(buffer);
+	return NULL;
+}
+
+static int
+generate_file_striped(struct file_data *data, int fd, unsigned int nthreads, size_t stripe)
+{
+	struct stripe_writer *writers;
+	unsigned int i;
+	int res = fd;
+
+	if (get_file_id(data, fd) < 0)
+		return -1;
+
+	if ((writers = calloc(nthreads, sizeof(*writers))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct stripe_writer *w = &writers[i];
+
+		w->data = data;
+		w->index = i;
+		w->nthreads = nthreads;
+		w->stripe = stripe;
+		if ((w->fd = reopen_file(data, fd)) < 0) {
+			nthreads = i;
+			res = -1;
+			break;
+		}
+		if (pthread_create(&w->thread, NULL, stripe_writer, w)) {
+			fprintf(stderr, "unable to create thread: %m\n");
+			close(w->fd);
+			nthreads = i;
+			res = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct stripe_writer *w = &writers[i];
+
+		pthread_join(w->thread, NULL);
+		close(w->fd);
+		if (w->error)
+			res = -1;
+		else if (!opt_quiet)
+			printf("  thread %2u: %lu bytes in %.3f seconds (%.1f MiB/s)\n",
+					i, (unsigned long) w->written, w->elapsed,
+					w->elapsed? w->written / w->elapsed / (1024 * 1024) : 0);
+	}
+
+	free(writers);
+	return res;
 }
 
 static int
@@ -2141,37 +2519,45 @@ static int
 verify_file(const char *ident, int fd, const struct file_data *data)
 {
 	unsigned long long verified;
+	unsigned char *buffer, *pattern;
+	int want, direct, okay = 0;
 
 	if (!opt_quiet) {
 		printf("Verifying contents of %s: ", ident);
 		fflush(stdout);
 	}
 
+	buffer = alloc_buffer(opt_bufsize);
+	pattern = alloc_buffer(opt_bufsize);
+	if (buffer == NULL || pattern == NULL)
+		goto out;
+	want = direct = !!(fcntl(fd, F_GETFL) & O_DIRECT);
+
 	lseek64(fd, data->offset, SEEK_SET);
 
 	for (verified = data->offset; verified < data->size; ) {
-		unsigned char buffer[4096], pattern[4096];
-		unsigned int chunk;
-		int n;
+		size_t chunk;
+		ssize_t n;
 
-		if ((chunk = data->size - verified) > sizeof(buffer))
-			chunk = sizeof(buffer);
+		chunk = next_chunk(verified, data->size, want);
 
 		n = generate_buffer(data, verified, pattern, pad32(chunk));
 		assert(n >= chunk);
 
+		direct = keep_direct(fd, want, direct, verified, chunk);
 		n = read(fd, buffer, chunk);
 		if (n < 0) {
 			printf("read error at %llu: %m\n", verified);
-			return 0;
+			goto out;
 		}
 		if (n != chunk) {
-			printf("short read at %llu (read %u rather than %u)\n", verified, n, chunk);
-			return 0;
+			printf("short read at %llu (read %lu rather than %lu)\n", verified,
+					(long) n, (long) chunk);
+			goto out;
 		}
 
 		if (memcmp(buffer, pattern, chunk)) {
-			unsigned int k;
+			size_t k;
 
 			if (!opt_quiet)
 				printf("FAILED\n");
@@ -2182,7 +2568,7 @@ verify_file(const char *ident, int fd, const struct file_data *data)
 			fprintf(stderr,
 				"%s: verification failed at offset %llu (%0llx)\n", ident,
 				verified + k, verified + k);
-			return 0;
+			goto out;
 		}
 
 		verified += n;
@@ -2190,7 +2576,242 @@ verify_file(const char *ident, int fd, const struct file_data *data)
 
 	if (!opt_quiet)
 		printf("OK\n");
-	return 1;
+	okay = 1;
+
+out:
+	free(buffer);
+	free(pattern);
+	return okay;
+}
+
+/*
+ * Verify the file from several threads, each of which reads a
+ * contiguous range of it with pread64(). Every thread stops at the
+ * first mismatch in its range, and keeps a log2 histogram of its
+ * read latencies.
+ */
+#define READ_LAT_BUCKETS	32
+
+struct range_verifier {
+	pthread_t		thread;
+	const struct file_data *data;
+	int			fd;
+	off64_t			start, end;
+	off64_t			mismatch;
+	size_t			verified;
+	double			elapsed;
+	int			error;
+	unsigned long		reads;
+	double			max_usec;
+	unsigned long		latency[READ_LAT_BUCKETS];
+};
+
+static void *
+range_verifier(void *arg)
+{
+	struct range_verifier *v = arg;
+	const struct file_data *data = v->data;
+	unsigned char *buffer, *pattern;
+	struct timeval t0, t1;
+	off64_t pos;
+	double usec;
+	unsigned int b;
+	int want, direct;
+
+	buffer = alloc_buffer(opt_bufsize);
+	pattern = alloc_buffer(opt_bufsize);
+	if (buffer == NULL || pattern == NULL) {
+		v->error = 1;
+		goto out;
+	}
+	want = direct = !!(fcntl(v->fd, F_GETFL) & O_DIRECT);
+
+	gettimeofday(&t0, NULL);
+	for (pos = v->start; pos < v->end; ) {
+		size_t chunk;
+		ssize_t n;
+
+		chunk = next_chunk(pos, v->end, want);
+		n = generate_buffer(data, pos, pattern, pad32(chunk));
+		assert(n >= chunk);
+
+		direct = keep_direct(v->fd, want, direct, pos, chunk);
+		gettimeofday(&t1, NULL);
+		n = pread64(v->fd, buffer, chunk, pos);
+		usec = elapsed_since(&t1) * 1e6;
+
+		v->reads++;
+		if (usec > v->max_usec)
+			v->max_usec = usec;
+		for (b = 0; b < READ_LAT_BUCKETS - 1 && (1UL << b) <= usec; b++)
+			;
+		v->latency[b]++;
+
+		if (n < 0) {
+			fprintf(stderr, "%s: read error at %llu: %m\n", data->name,
+					(unsigned long long) pos);
+			v->error = 1;
+			break;
+		}
+		if (n != chunk) {
+			fprintf(stderr, "%s: short read at %llu (read %lu rather than %lu)\n",
+					data->name, (unsigned long long) pos, (long) n, (long) chunk);
+			v->error = 1;
+			break;
+		}
+
+		if (memcmp(buffer, pattern, chunk)) {
+			size_t k;
+
+			for (k = 0; k < chunk && pattern[k] == buffer[k]; ++k)
+				;
+			v->mismatch = pos + k;
+			break;
+		}
+
+		pos += n;
+		v->verified += n;
+	}
+	v->elapsed = elapsed_since(&t0);
+
+out:
+	free(buffer);
+	free(pattern);
+	return NULL;
+}
+
+/*
+ * Upper bound of the latency bucket below which the given
+ * percentage of reads fall
+ */
+static unsigned long
+range_latency_percentile(const struct range_verifier *v, unsigned int percent)
+{
+	unsigned long count = 0;
+	unsigned int b;
+
+	for (b = 0; b < READ_LAT_BUCKETS - 1; ++b) {
+		count += v->latency[b];
+		if (100 * count >= percent * v->reads)
+			break;
+	}
+	return 1UL << b;
+}
+
+static void
+range_report(unsigned int index, const struct range_verifier *v)
+{
+	unsigned int b;
+
+	if (v->start == v->end)
+		return;
+
+	printf("  range %2u [%llu, %llu): %lu bytes in %.3f seconds (%.1f MiB/s)\n",
+			index,
+			(unsigned long long) v->start,
+			(unsigned long long) v->end,
+			(unsigned long) v->verified, v->elapsed,
+			v->elapsed? v->verified / v->elapsed / (1024 * 1024) : 0);
+	if (v->reads == 0)
+		return;
+
+	printf("    %lu reads, latency p50 <= %luus, p99 <= %luus, max %.0fus\n",
+			v->reads,
+			range_latency_percentile(v, 50),
+			range_latency_percentile(v, 99),
+			v->max_usec);
+	for (b = 0; b < READ_LAT_BUCKETS; ++b) {
+		unsigned long count = v->latency[b];
+
+		if (count != 0)
+			printf("    %8lu .. %8luus: %8lu (%2lu%%)\n",
+					b? 1UL << (b - 1) : 0, 1UL << b,
+					count, 100 * count / v->reads);
+	}
+}
+
+/*
+ * File offset at which a range starts, rounded up to the given alignment
+ */
+static off64_t
+range_boundary(off64_t offset, unsigned long long length, unsigned long long pos,
+		unsigned long long align)
+{
+	if (pos == 0)
+		return offset;
+	pos = (offset + pos + align - 1) & ~(align - 1);
+	return MIN(pos, offset + length);
+}
+
+static int
+verify_file_parallel(const char *ident, int fd, const struct file_data *data, unsigned int nthreads)
+{
+	struct range_verifier *verifiers;
+	unsigned long long length, per_thread, align;
+	unsigned int i;
+	int okay = 1;
+
+	if (!opt_quiet) {
+		printf("Verifying contents of %s with %u threads: ", ident, nthreads);
+		fflush(stdout);
+	}
+
+	if ((verifiers = calloc(nthreads, sizeof(*verifiers))) == NULL) {
+		perror("calloc");
+		return 0;
+	}
+
+	/* Ranges must start on a record boundary, and with O_DIRECT
+	 * on a page boundary */
+	align = (fcntl(fd, F_GETFL) & O_DIRECT)? getpagesize() : 32;
+	length = (data->size > data->offset)? data->size - data->offset : 0;
+	per_thread = (length + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads; i++) {
+		struct range_verifier *v = &verifiers[i];
+
+		v->data = data;
+		v->mismatch = -1;
+		v->start = range_boundary(data->offset, length, i * per_thread, align);
+		v->end = range_boundary(data->offset, length, (i + 1) * per_thread, align);
+		if ((v->fd = reopen_file(data, fd)) < 0) {
+			nthreads = i;
+			okay = 0;
+			break;
+		}
+		if (pthread_create(&v->thread, NULL, range_verifier, v)) {
+			fprintf(stderr, "unable to create thread: %m\n");
+			close(v->fd);
+			nthreads = i;
+			okay = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(verifiers[i].thread, NULL);
+		close(verifiers[i].fd);
+		if (verifiers[i].error || verifiers[i].mismatch >= 0)
+			okay = 0;
+	}
+
+	if (!opt_quiet)
+		printf("%s\n", okay? "OK" : "FAILED");
+
+	for (i = 0; i < nthreads; i++) {
+		struct range_verifier *v = &verifiers[i];
+
+		if (v->mismatch >= 0)
+			fprintf(stderr,
+				"%s: verification failed at offset %llu (%0llx) in range %u\n", ident,
+				(unsigned long long) v->mismatch,
+				(unsigned long long) v->mismatch, i);
+		if (!opt_quiet)
+			range_report(i, v);
+	}
+
+	free(verifiers);
+	return okay;
 }
 
 static const char *